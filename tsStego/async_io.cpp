@@ -0,0 +1,729 @@
+// async_io.cpp
+// Released under the MIT License
+//
+// Background file reads and writes, so the CPU work of one job overlaps the I/O of the next
+//
+// Every file tsStego reads or writes goes through here. Reads can be started early with
+// async_io_prefetch and picked up later by async_io_read (or given back with async_io_cancel_prefetch),
+// and async_io_write returns as soon as the data has been handed off, with a future that says how the
+// write went. A read of a file that still has a write in flight is answered from the data being
+// written, and a write throws away any stale prefetched copy of its file, so jobs see the same files
+// they would if everything ran in order.
+//
+// On Linux the requests go to the kernel through io_uring, which keeps many reads and writes queued on
+// the device from a single thread. Where io_uring isn't available (Windows, older kernels, or a build with
+// TSSTEGO_NO_IO_URING defined) a small pool of threads does blocking reads and writes instead.
+//
+// The filename "-" means stdin for reads and stdout for writes. Stdin is read once, in full, the first time
+// it's asked for, and writes to stdout happen right away rather than in the background, so they come
+// out in order.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <exception>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#if defined(__linux__) && !defined(TSSTEGO_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define TSSTEGO_IO_URING
+#endif
+#endif
+
+#ifdef TSSTEGO_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#endif
+
+#define IO_THREAD_POOL_SIZE 4
+#define IO_URING_QUEUE_DEPTH 64
+#define IO_MAX_TRANSFER (1 << 30) // Largest single read or write handed to the kernel
+#define STDIO_FILENAME "-"
+
+// One file being read or written
+struct io_request
+{
+	std::string filename;
+	bool write;
+	std::vector<unsigned char> data; // The file contents read, or to be written
+	std::promise<void> promise;
+	std::shared_future<void> done;
+	// Progress through the file, for io_uring's partial transfers
+	int fd;
+	size_t offset;
+#ifdef TSSTEGO_IO_URING
+	struct iovec iov;
+#endif
+
+	io_request(const std::string& name, bool is_write) : filename(name), write(is_write), fd(-1), offset(0)
+	{
+		done = promise.get_future().share();
+	}
+};
+
+static void fail_request(io_request& request, const char* what)
+{
+	std::string err = std::string(what) + " " + request.filename;
+	request.promise.set_exception(std::make_exception_ptr(std::exception(err.c_str())));
+}
+
+class io_backend
+{
+public:
+	virtual ~io_backend() {}
+	// Start the request, which the backend keeps alive until it has completed
+	virtual void submit(std::shared_ptr<io_request> request) = 0;
+	virtual const char* name() const = 0;
+};
+
+// Blocking reads and writes on a few threads of our own
+class thread_pool_backend : public io_backend
+{
+	std::mutex mutex;
+	std::condition_variable queued;
+	std::deque<std::shared_ptr<io_request>> queue;
+	std::vector<std::thread> threads;
+	bool stopping;
+
+	static void run(io_request& request)
+	{
+		if (request.write)
+		{
+			FILE* file = fopen(request.filename.c_str(), "wb");
+			bool ok = file != 0;
+			if (ok && request.data.size())
+				ok = fwrite(&request.data[0], 1, request.data.size(), file) == request.data.size();
+			if (file && fclose(file) != 0)
+				ok = false;
+			if (ok)
+				request.promise.set_value();
+			else
+				fail_request(request, "Exception in async_io_write: unable to write");
+			return;
+		}
+
+		// A missing file reads as empty, like lodepng::load_file, but one that can't be read to the end fails
+		FILE* file = fopen(request.filename.c_str(), "rb");
+		bool ok = true;
+		if (file)
+		{
+			unsigned char buffer[65536];
+			size_t count;
+			while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+				request.data.insert(request.data.end(), buffer, buffer + count);
+			ok = !ferror(file);
+			fclose(file);
+		}
+		if (ok)
+			request.promise.set_value();
+		else
+			fail_request(request, "Exception in async_io_read: unable to read");
+	}
+
+	void worker()
+	{
+		for (;;)
+		{
+			std::shared_ptr<io_request> request;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (queue.empty() && !stopping)
+					queued.wait(lock);
+				if (queue.empty())
+					return;
+				request = queue.front();
+				queue.pop_front();
+			}
+			try
+			{
+				run(*request);
+			}
+			catch (...)
+			{
+				fail_request(*request, request->write ? "Exception in async_io_write: unable to write" :
+					"Exception in async_io_read: unable to read");
+			}
+		}
+	}
+
+public:
+	thread_pool_backend() : stopping(false)
+	{
+		for (int i = 0; i < IO_THREAD_POOL_SIZE; i++)
+			threads.push_back(std::thread(&thread_pool_backend::worker, this));
+	}
+
+	~thread_pool_backend()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		queued.notify_all();
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	void submit(std::shared_ptr<io_request> request)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(request);
+		}
+		queued.notify_one();
+	}
+
+	const char* name() const { return "thread pool"; }
+};
+
+#ifdef TSSTEGO_IO_URING
+// io_uring through the raw system calls, so there's no dependency on liburing
+// Any thread may submit (under sq_mutex), and one reaper thread takes the completions, resubmitting the
+// rest of a file after a partial transfer
+class io_uring_backend : public io_backend
+{
+	int ring_fd;
+	unsigned int entries;
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	io_uring_sqe* sqes;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	io_uring_cqe* cqes;
+
+	std::mutex sq_mutex;
+	std::condition_variable sq_space;
+	unsigned int in_flight; // Operations submitted and not yet reaped, at most entries
+	std::map<io_request*, std::shared_ptr<io_request>> requests;
+	std::thread reaper;
+	// For reading what isn't a regular file (a pipe, say), whose size can't be known up front
+	std::unique_ptr<thread_pool_backend> blocking;
+
+	static unsigned int* ring_field(void* ring, unsigned int offset)
+	{
+		return (unsigned int*)((unsigned char*)ring + offset);
+	}
+
+	// Queue one read or write of the next part of the request, or a wake up for the reaper if request is null
+	// The reaper continuing a request passes continuing, to reuse the slot of the operation that just
+	// completed rather than wait for one: only the reaper frees slots, so it mustn't ever wait for them
+	// Call with sq_mutex held
+	void push_operation(std::unique_lock<std::mutex>& lock, io_request* request, bool continuing = false)
+	{
+		while (!continuing && in_flight >= entries)
+			sq_space.wait(lock);
+
+		unsigned int tail = *sq_tail;
+		unsigned int index = tail & *sq_mask;
+		io_uring_sqe* sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		if (request)
+		{
+			size_t length = request->data.size() - request->offset;
+			request->iov.iov_base = &request->data[request->offset];
+			request->iov.iov_len = length < IO_MAX_TRANSFER ? length : IO_MAX_TRANSFER;
+			sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = request->fd;
+			sqe->addr = (unsigned long long)(uintptr_t)&request->iov;
+			sqe->len = 1;
+			sqe->off = request->offset;
+		}
+		else
+			sqe->opcode = IORING_OP_NOP;
+		sqe->user_data = (unsigned long long)(uintptr_t)request;
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		if (!continuing)
+			in_flight++;
+
+		while (syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, 0, 0) < 0 && errno == EINTR)
+			;
+	}
+
+	void finish(io_request* request, const char* error)
+	{
+		std::shared_ptr<io_request> keep;
+		{
+			std::lock_guard<std::mutex> lock(sq_mutex);
+			keep = requests[request];
+			requests.erase(request);
+		}
+		if (request->fd >= 0 && close(request->fd) != 0 && !error && request->write)
+			error = "Exception in async_io_write: unable to write";
+		request->fd = -1;
+		if (error)
+			fail_request(*request, error);
+		else
+			request->promise.set_value();
+	}
+
+	void reap()
+	{
+		for (;;)
+		{
+			while (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno == EINTR)
+				;
+
+			unsigned int head = *cq_head;
+			unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			bool stop = false;
+			for (; head != tail; head++)
+			{
+				io_uring_cqe cqe = cqes[head & *cq_mask];
+				__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+				io_request* request = (io_request*)(uintptr_t)cqe.user_data;
+				if (request && cqe.res > 0 && request->offset + cqe.res < request->data.size())
+				{
+					// The rest of the file goes in this operation's slot
+					request->offset += cqe.res;
+					std::unique_lock<std::mutex> lock(sq_mutex);
+					push_operation(lock, request, true);
+					continue;
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(sq_mutex);
+					in_flight--;
+				}
+				sq_space.notify_one();
+				if (!request)
+				{
+					stop = true;
+					continue;
+				}
+				if (cqe.res < 0)
+				{
+					finish(request, request->write ? "Exception in async_io_write: unable to write" :
+						"Exception in async_io_read: unable to read");
+					continue;
+				}
+				if (cqe.res == 0 && !request->write) // The file got shorter since we looked at it
+					request->data.resize(request->offset);
+				request->offset += cqe.res;
+				finish(request, cqe.res == 0 && request->write ? "Exception in async_io_write: unable to write" : 0);
+			}
+			if (stop)
+				return;
+		}
+	}
+
+public:
+	io_uring_backend() : ring_fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes((io_uring_sqe*)MAP_FAILED), in_flight(0)
+	{
+	}
+
+	// Returns false if the kernel doesn't support io_uring (or won't let us use it)
+	bool init()
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		ring_fd = (int)syscall(__NR_io_uring_setup, IO_URING_QUEUE_DEPTH, &params);
+		if (ring_fd < 0)
+			return false;
+		entries = params.sq_entries;
+
+		sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			if (cq_ring_size > sq_ring_size)
+				sq_ring_size = cq_ring_size;
+			cq_ring_size = sq_ring_size;
+		}
+		sq_ring = mmap(0, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ring == MAP_FAILED)
+			return false;
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			cq_ring = sq_ring;
+		else
+			cq_ring = mmap(0, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+			return false;
+		sqes = (io_uring_sqe*)mmap(0, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+
+		sq_head = ring_field(sq_ring, params.sq_off.head);
+		sq_tail = ring_field(sq_ring, params.sq_off.tail);
+		sq_mask = ring_field(sq_ring, params.sq_off.ring_mask);
+		sq_array = ring_field(sq_ring, params.sq_off.array);
+		cq_head = ring_field(cq_ring, params.cq_off.head);
+		cq_tail = ring_field(cq_ring, params.cq_off.tail);
+		cq_mask = ring_field(cq_ring, params.cq_off.ring_mask);
+		cqes = (io_uring_cqe*)((unsigned char*)cq_ring + params.cq_off.cqes);
+
+		reaper = std::thread(&io_uring_backend::reap, this);
+		return true;
+	}
+
+	~io_uring_backend()
+	{
+		if (reaper.joinable())
+		{
+			{
+				std::unique_lock<std::mutex> lock(sq_mutex);
+				push_operation(lock, 0);
+			}
+			reaper.join();
+		}
+		if (sqes != MAP_FAILED)
+			munmap(sqes, entries * sizeof(io_uring_sqe));
+		if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+			munmap(cq_ring, cq_ring_size);
+		if (sq_ring != MAP_FAILED)
+			munmap(sq_ring, sq_ring_size);
+		if (ring_fd >= 0)
+			close(ring_fd);
+	}
+
+	void submit(std::shared_ptr<io_request> request)
+	{
+		// Opening the file is quick next to transferring it, so that's done right here
+		if (request->write)
+			request->fd = open(request->filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		else
+			request->fd = open(request->filename.c_str(), O_RDONLY | O_CLOEXEC);
+		if (request->fd < 0)
+		{
+			if (request->write)
+				fail_request(*request, "Exception in async_io_write: unable to write");
+			else
+				request->promise.set_value(); // A missing file reads as empty, like lodepng::load_file
+			return;
+		}
+
+		if (!request->write)
+		{
+			struct stat info;
+			if (fstat(request->fd, &info) != 0 || !S_ISREG(info.st_mode))
+			{
+				close(request->fd);
+				request->fd = -1;
+				{
+					std::lock_guard<std::mutex> lock(sq_mutex);
+					if (!blocking)
+						blocking.reset(new thread_pool_backend());
+				}
+				blocking->submit(request);
+				return;
+			}
+			request->data.resize((size_t)info.st_size);
+		}
+		if (request->data.empty())
+		{
+			close(request->fd);
+			request->fd = -1;
+			request->promise.set_value();
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(sq_mutex);
+		requests[request.get()] = request;
+		push_operation(lock, request.get());
+	}
+
+	const char* name() const { return "io_uring"; }
+};
+#endif // TSSTEGO_IO_URING
+
+// Reads waiting to be picked up, and writes that may still be in flight
+class async_file_io
+{
+	std::unique_ptr<io_backend> backend;
+	std::mutex mutex;
+	struct prefetched_file
+	{
+		std::shared_ptr<io_request> request;
+		unsigned int readers; // async_io_read calls still to come for this read
+	};
+	std::map<std::string, prefetched_file> prefetched;
+	std::map<std::string, std::shared_ptr<io_request>> writes;
+	bool stdin_read;
+	std::vector<unsigned char> stdin_data; // Until async_io_read takes it
+
+	// Read all of stdin the first time it's needed, in binary
+	// Call with mutex held
+	void read_stdin()
+	{
+		if (stdin_read)
+			return;
+		stdin_read = true;
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		unsigned char buffer[65536];
+		size_t count;
+		while ((count = fread(buffer, 1, sizeof(buffer), stdin)) > 0)
+			stdin_data.insert(stdin_data.end(), buffer, buffer + count);
+	}
+
+	void write_stdout(std::vector<unsigned char>& data)
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		bool ok = data.empty() || fwrite(&data[0], 1, data.size(), stdout) == data.size();
+		if (fflush(stdout) != 0 || !ok)
+			throw std::exception("Exception in async_io_write: unable to write to stdout");
+		data.clear();
+	}
+
+	// Forget about writes that have finished, whose callers have their futures to find out how they went
+	// Call with mutex held
+	void collect_writes()
+	{
+		for (auto i = writes.begin(); i != writes.end();)
+		{
+			if (i->second->done.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+				i = writes.erase(i);
+			else
+				++i;
+		}
+	}
+
+	std::shared_ptr<io_request> start_read(const std::string& filename)
+	{
+		std::shared_ptr<io_request> request(new io_request(filename, false));
+		auto pending = writes.find(filename);
+		if (pending != writes.end())
+		{
+			// Whatever's on disk may be half written, but we know what it's going to be
+			request->data = pending->second->data;
+			request->promise.set_value();
+		}
+		else
+			backend->submit(request);
+		return request;
+	}
+
+public:
+	async_file_io() : stdin_read(false)
+	{
+#ifdef TSSTEGO_IO_URING
+		io_uring_backend* ring = new io_uring_backend();
+		if (ring->init())
+			backend.reset(ring);
+		else
+			delete ring;
+#endif
+		if (!backend)
+			backend.reset(new thread_pool_backend());
+	}
+
+	void prefetch(const std::string& filename)
+	{
+		if (filename == STDIO_FILENAME)
+			return;
+		std::lock_guard<std::mutex> lock(mutex);
+		collect_writes();
+		prefetched_file& file = prefetched[filename];
+		if (!file.request)
+			file.request = start_read(filename);
+		file.readers++;
+	}
+
+	void cancel_prefetch(const std::string& filename)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto file = prefetched.find(filename);
+		if (file != prefetched.end() && --file->second.readers == 0)
+			prefetched.erase(file); // A read still in flight lets go of its data once it's done
+	}
+
+	std::vector<unsigned char> read(const std::string& filename)
+	{
+		std::shared_ptr<io_request> request;
+		bool last_reader = true;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (filename == STDIO_FILENAME)
+			{
+				read_stdin();
+				return std::move(stdin_data);
+			}
+			collect_writes();
+			auto file = prefetched.find(filename);
+			if (file != prefetched.end())
+			{
+				request = file->second.request;
+				last_reader = --file->second.readers == 0;
+				if (last_reader)
+					prefetched.erase(file);
+			}
+			else
+				request = start_read(filename);
+		}
+
+		request->done.get(); // Rethrows a failed read
+		if (last_reader)
+			return std::move(request->data);
+		return request->data;
+	}
+
+	std::vector<unsigned char> peek(const std::string& filename, size_t size)
+	{
+		std::vector<unsigned char> start;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (filename == STDIO_FILENAME)
+			{
+				read_stdin();
+				start.assign(stdin_data.begin(), stdin_data.begin() + (stdin_data.size() < size ? stdin_data.size() : size));
+				return start;
+			}
+			collect_writes();
+			std::shared_ptr<io_request> known;
+			auto pending = writes.find(filename);
+			auto file = prefetched.find(filename);
+			if (pending != writes.end())
+				known = pending->second;
+			else if (file != prefetched.end() &&
+				file->second.request->done.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+				known = file->second.request;
+			if (known)
+			{
+				size_t count = known->data.size() < size ? known->data.size() : size;
+				start.assign(known->data.begin(), known->data.begin() + count);
+				return start;
+			}
+		}
+
+		// Not worth queueing behind whole files for a few bytes
+		FILE* f = fopen(filename.c_str(), "rb");
+		if (f)
+		{
+			start.resize(size);
+			if (size)
+				start.resize(fread(&start[0], 1, size, f));
+			fclose(f);
+		}
+		return start;
+	}
+
+	std::shared_future<void> write(const std::string& filename, std::vector<unsigned char>& data)
+	{
+		if (filename == STDIO_FILENAME)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			write_stdout(data);
+			std::promise<void> written;
+			written.set_value();
+			return written.get_future().share();
+		}
+
+		std::shared_ptr<io_request> request(new io_request(filename, true));
+		request->data.swap(data);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			collect_writes();
+			prefetched.erase(filename); // Whatever was read is about to be out of date
+			auto pending = writes.find(filename);
+			if (pending != writes.end())
+				pending->second->done.wait(); // Two writes to one file have to land in order
+			writes[filename] = request;
+		}
+		backend->submit(request);
+		return request->done;
+	}
+
+	void drain()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!writes.empty())
+		{
+			std::shared_ptr<io_request> pending = writes.begin()->second;
+			lock.unlock();
+			pending->done.wait();
+			lock.lock();
+			collect_writes();
+		}
+	}
+
+	const char* backend_name() const { return backend->name(); }
+};
+
+static async_file_io& file_io()
+{
+	static async_file_io io;
+	return io;
+}
+
+// Start reading a file that async_io_read will ask for later
+// Each prefetch is good for one async_io_read of the file
+void async_io_prefetch(const std::string& filename)
+{
+	file_io().prefetch(filename);
+}
+
+// Give back one async_io_prefetch of a file that no async_io_read is going to pick up now (e.g. the job
+// that would have read it failed first), so its data isn't held until exit
+void async_io_cancel_prefetch(const std::string& filename)
+{
+	file_io().cancel_prefetch(filename);
+}
+
+// The contents of a file, empty if it can't be opened
+// Waits for a prefetched read to finish, or reads the file now if it wasn't prefetched
+// Throws an exception if reading fails part way
+std::vector<unsigned char> async_io_read(const std::string& filename)
+{
+	return file_io().read(filename);
+}
+
+// The first size bytes of a file, or fewer if it's shorter (none if it can't be opened)
+// Answered from a finished prefetch or a write in flight if there is one, or read right away if not
+std::vector<unsigned char> async_io_peek(const std::string& filename, size_t size)
+{
+	return file_io().peek(filename, size);
+}
+
+// Write a file in the background, taking the data (data is left empty)
+// The returned future is ready once the write has finished, and rethrows the exception if it failed
+// Stdout is written before returning, and throws right away if that fails
+std::shared_future<void> async_io_write(const std::string& filename, std::vector<unsigned char>& data)
+{
+	return file_io().write(filename, data);
+}
+
+// Wait for every write to finish
+// How each one went is up to whoever holds its future (see async_io_write)
+void async_io_drain()
+{
+	file_io().drain();
+}
+
+// "io_uring" or "thread pool"
+const char* async_io_backend_name()
+{
+	return file_io().backend_name();
+}
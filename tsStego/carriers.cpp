@@ -0,0 +1,276 @@
+// carriers.cpp
+// Released under the MIT License
+//
+// Finding the images a payload is spread across (see run_shard and run_unshard in tsStego.cpp), either
+// every PNG file in a directory or a comma-separated list of files, and the carrier pools --carrier-pool
+// picks an encode's carrier from
+//
+// A carrier pool is a directory of PNG images. Choosing from it only needs each image's dimensions, color
+// type and whether it has a tRNS chunk, so those are kept in an index file in the directory, along with
+// each file's size and modification time. Only images that are new or have changed since the index was written are inspected
+// again, and the index is rewritten whenever anything has changed. A pool is only read once per run.
+//
+// Index file, one line per image after the first, which is the signature:
+//		size modification_time width height colortype bitdepth color_key filename
+// Files that aren't readable PNG images are kept with a width and height of 0, so they aren't looked at
+// again either
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <exception>
+#include <algorithm>
+#include <cctype>
+#include "lodepng.h"
+#include "carriers.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+#define POOL_INDEX_FILENAME "tsStego_pool.idx"
+#define POOL_INDEX_SIGNATURE "tsStego carrier pool 2"
+#define PEEK_START_BYTES 4096 // Enough for the chunks before IDAT in most files
+
+// From async_io.cpp:
+std::vector<unsigned char> async_io_peek(const std::string& filename, size_t size);
+
+// An image as the pool index records it
+struct pool_entry
+{
+	carrier_info info;
+	unsigned long long size;
+	unsigned long long modified;
+
+	pool_entry() : size(0), modified(0) {}
+};
+
+// The pools already read this run, by directory
+static std::map<std::string, std::vector<carrier_info> > loaded_pools;
+static std::mutex loaded_pools_mutex;
+
+static bool is_directory(const std::string& path)
+{
+#ifdef _WIN32
+	DWORD attributes = GetFileAttributesA(path.c_str());
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat info;
+	return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+// The size and modification time of a file, for telling whether its index entry is still good
+static bool get_file_stamp(const std::string& path, unsigned long long& size, unsigned long long& modified)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data))
+		return false;
+	size = ((unsigned long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	modified = ((unsigned long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return false;
+	size = (unsigned long long)info.st_size;
+	modified = (unsigned long long)info.st_mtime;
+#endif
+	return true;
+}
+
+static bool has_png_extension(const std::string& name)
+{
+	if (name.size() < 4)
+		return false;
+	std::string extension = name.substr(name.size() - 4);
+	for (auto& c : extension)
+		c = (char)tolower((unsigned char)c);
+	return extension == ".png";
+}
+
+// The PNG files spec stands for: every .png file directly inside it, sorted by name, if it's a directory,
+// or else the files in its comma-separated list, in the order given
+void list_png_files(const std::string& spec, std::vector<std::string>& files)
+{
+	files.clear();
+	if (!is_directory(spec))
+	{
+		size_t start = 0;
+		for (;;)
+		{
+			size_t comma = spec.find(',', start);
+			std::string file = spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+			if (!file.empty())
+				files.push_back(file);
+			if (comma == std::string::npos)
+				break;
+			start = comma + 1;
+		}
+		return;
+	}
+
+	std::string directory = spec;
+	if (directory[directory.size() - 1] != '/' && directory[directory.size() - 1] != '\\')
+		directory += '/';
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA found;
+	HANDLE find = FindFirstFileA((directory + "*.png").c_str(), &found);
+	if (find != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && has_png_extension(found.cFileName))
+				files.push_back(directory + found.cFileName);
+		} while (FindNextFileA(find, &found));
+		FindClose(find);
+	}
+#else
+	DIR* dir = opendir(directory.c_str());
+	if (dir)
+	{
+		while (struct dirent* entry = readdir(dir))
+		{
+			std::string path = directory + entry->d_name;
+			if (has_png_extension(entry->d_name) && !is_directory(path))
+				files.push_back(path);
+		}
+		closedir(dir);
+	}
+#endif
+
+	std::sort(files.begin(), files.end());
+}
+
+// Whether a PNG file has a tRNS chunk, reading no further into it than the first IDAT chunk
+// The chunks before it are usually small, so only the start of the file is read, and more only if they
+// go on past it
+bool peek_trns_chunk(const std::string& filename)
+{
+	size_t size = PEEK_START_BYTES;
+	for (;;)
+	{
+		std::vector<unsigned char> png = async_io_peek(filename, size);
+		size_t offset = 8; // The signature
+		while (offset + 12 <= png.size())
+		{
+			const unsigned char* chunk = &png[offset];
+			if (lodepng_chunk_type_equals(chunk, "IDAT"))
+				return false;
+			if (lodepng_chunk_type_equals(chunk, "tRNS"))
+				return true;
+			if (lodepng_chunk_length(chunk) > 2147483647)
+				return false; // Past the largest chunk PNG allows, so it isn't one
+			offset += (size_t)lodepng_chunk_length(chunk) + 12;
+		}
+		if (png.size() < size)
+			return false; // The whole file has been looked at
+		size *= 2; // Never more than twice the file, whatever its chunk lengths say
+	}
+}
+
+// Read the dimensions and color type of an image from its PNG header, and whether it has a tRNS chunk,
+// leaving them 0 if it isn't one
+static void inspect_carrier(pool_entry& entry)
+{
+	// 8 byte signature, then the IHDR chunk: 4 byte length, 4 byte type, 13 bytes of data, 4 byte CRC
+	std::vector<unsigned char> header = async_io_peek(entry.info.filename, 33);
+	lodepng::State state;
+	unsigned int width = 0, height = 0;
+	if (header.size() < 33 || lodepng_inspect(&width, &height, &state, &header[0], header.size()))
+		return;
+	entry.info.width = width;
+	entry.info.height = height;
+	entry.info.colortype = state.info_png.color.colortype;
+	entry.info.bitdepth = state.info_png.color.bitdepth;
+	entry.info.color_key = peek_trns_chunk(entry.info.filename);
+}
+
+void get_carrier_pool(const std::string& directory, std::vector<carrier_info>& carriers)
+{
+	std::lock_guard<std::mutex> lock(loaded_pools_mutex);
+	auto loaded = loaded_pools.find(directory);
+	if (loaded != loaded_pools.end())
+	{
+		carriers = loaded->second;
+		return;
+	}
+
+	if (!is_directory(directory))
+		throw std::exception("Exception in get_carrier_pool: the carrier pool isn't a directory");
+	std::vector<std::string> files;
+	list_png_files(directory, files);
+	std::string prefix = directory;
+	if (prefix[prefix.size() - 1] != '/' && prefix[prefix.size() - 1] != '\\')
+		prefix += '/';
+
+	// What the index said last time, by filename within the directory
+	std::map<std::string, pool_entry> indexed;
+	std::ifstream index_in((prefix + POOL_INDEX_FILENAME).c_str());
+	std::string line;
+	if (std::getline(index_in, line) && line == POOL_INDEX_SIGNATURE)
+	{
+		while (std::getline(index_in, line))
+		{
+			std::istringstream fields(line);
+			pool_entry entry;
+			std::string name;
+			if (fields >> entry.size >> entry.modified >> entry.info.width >> entry.info.height >>
+				entry.info.colortype >> entry.info.bitdepth >> entry.info.color_key && std::getline(fields >> std::ws, name) && !name.empty())
+				indexed[name] = entry;
+		}
+	}
+	index_in.close();
+
+	std::vector<pool_entry> entries;
+	bool changed = false;
+	for (auto& file : files)
+	{
+		pool_entry entry;
+		if (!get_file_stamp(file, entry.size, entry.modified))
+			continue;
+		auto known = indexed.find(file.substr(prefix.size()));
+		if (known != indexed.end() && known->second.size == entry.size && known->second.modified == entry.modified)
+			entry.info = known->second.info;
+		else
+		{
+			entry.info.filename = file;
+			inspect_carrier(entry);
+			changed = true;
+		}
+		entry.info.filename = file;
+		entries.push_back(entry);
+	}
+	if (entries.size() != indexed.size())
+		changed = true; // Some have gone
+
+	// If the index can't be written (e.g. a read-only directory), the pool still works, it just has to be
+	// inspected again next time
+	if (changed)
+	{
+		std::ofstream index_out((prefix + POOL_INDEX_FILENAME).c_str());
+		index_out << POOL_INDEX_SIGNATURE << std::endl;
+		for (auto& entry : entries)
+		{
+			index_out << entry.size << " " << entry.modified << " " << entry.info.width << " " << entry.info.height << " ";
+			index_out << entry.info.colortype << " " << entry.info.bitdepth << " " << entry.info.color_key << " ";
+			index_out << entry.info.filename.substr(prefix.size()) << std::endl;
+		}
+	}
+
+	carriers.clear();
+	for (auto& entry : entries)
+		if (entry.info.width && entry.info.height)
+			carriers.push_back(entry.info);
+	if (carriers.empty())
+		throw std::exception("Exception in get_carrier_pool: no PNG images in the carrier pool");
+	loaded_pools[directory] = carriers;
+}
@@ -0,0 +1,37 @@
+// carriers.h
+// Released under the MIT License
+//
+// Finding carrier images: the images a payload is spread across, and the pools an encode picks its
+// carrier from
+// See carriers.cpp
+
+#ifndef TSSTEGO_CARRIERS_H
+#define TSSTEGO_CARRIERS_H
+
+#include <string>
+#include <vector>
+
+// What a pool's index knows about one of its images, all of it from the PNG header
+struct carrier_info
+{
+	std::string filename; // Including the pool's directory
+	unsigned int width, height;
+	unsigned int colortype; // LodePNGColorType
+	unsigned int bitdepth;
+	bool color_key; // Has a tRNS chunk, so it's embedded as RGBA8 (see is_native_embeddable in tsStego.cpp)
+
+	carrier_info() : width(0), height(0), colortype(0), bitdepth(0), color_key(false) {}
+};
+
+// The PNG files spec stands for: every .png file directly inside it, sorted by name, if it's a directory,
+// or else the files in its comma-separated list, in the order given
+void list_png_files(const std::string& spec, std::vector<std::string>& files);
+
+// Whether a PNG file has a tRNS chunk, reading no further into it than the first IDAT chunk
+bool peek_trns_chunk(const std::string& filename);
+
+// Every PNG image in the directory, from the pool index kept there (see carriers.cpp)
+// Throws std::exception if the directory has no images
+void get_carrier_pool(const std::string& directory, std::vector<carrier_info>& carriers);
+
+#endif // TSSTEGO_CARRIERS_H
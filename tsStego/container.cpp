@@ -0,0 +1,234 @@
+// container.cpp
+// Released under the MIT License
+//
+// What gets embedded when the text isn't just encrypted in one piece: text compression, and the chunked
+// container
+//
+// A plain CFB payload is one cipher text, so getting at any part of the text means extracting and
+// decrypting everything before it, and a compressed payload has to be inflated from the start in any
+// mode. The chunked container splits the text into fixed-size chunks that are each compressed
+// (optionally) and encrypted on their own, behind a table of their sizes, so a reader can work out where
+// any chunk is, extract just that chunk from the image and decrypt it.
+//
+// Chunked container, all integers little endian:
+//		4 byte chunk size (bytes of text per chunk, the last chunk may be shorter)
+//		4 byte chunk count
+//		8 byte text length
+//		then for each chunk, 4 byte stored size (bytes of the chunk's data, not counting its header)
+//		then the chunks, each a chunk header followed by its data:
+//			4 byte chunk index
+//			4 byte stored size
+//			4 byte text size
+//			1 byte flags (CHUNK_FLAG_*)
+//			3 bytes, zero
+//			16 byte initialization vector
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <exception>
+#include <functional>
+#include <cstring>
+#include "lodepng.h"
+
+#define CONTAINER_HEADER_SIZE 16
+#define CHUNK_TABLE_ENTRY_SIZE 4
+#define CHUNK_HEADER_SIZE 32
+#define CHUNK_IV_OFFSET 16
+#define CHUNK_FLAG_COMPRESSED 0x1 // The chunk's text was compressed before it was encrypted
+
+// Reads count bytes of the embedded payload, starting offset bytes in, into bytes
+typedef std::function<void(size_t offset, size_t count, unsigned char* bytes)> payload_reader;
+
+// From crypto.cpp:
+void openssl_aes_cfb(const std::string& key_string, const unsigned char* iv, const unsigned char* input,
+	unsigned char* output, size_t size, bool encrypt);
+void openssl_aes_ctr(const std::string& key_string, const unsigned char* iv, const unsigned char* input,
+	unsigned char* output, size_t size, unsigned long long offset);
+void openssl_aes_chunk_iv(const unsigned char* payload_iv, unsigned long long chunk, unsigned char* iv);
+
+static void put_le(unsigned char* out, unsigned long long value, unsigned int bytes)
+{
+	for (unsigned int i = 0; i < bytes; i++)
+		out[i] = (unsigned char)(value >> (8 * i));
+}
+
+static unsigned long long get_le(const unsigned char* in, unsigned int bytes)
+{
+	unsigned long long value = 0;
+	for (unsigned int i = 0; i < bytes; i++)
+		value |= (unsigned long long)in[i] << (8 * i);
+	return value;
+}
+
+// Compress the text before it's encrypted, with the zlib encoder lodepng already has for PNG data
+// Returns false, leaving compressed empty, if that doesn't make the text any smaller
+// Throws std::exception on error
+bool compress_text(const unsigned char* plaintext, size_t size, std::vector<unsigned char>& compressed)
+{
+	compressed.clear();
+	unsigned int error = lodepng::compress(compressed, plaintext, size);
+	if (error)
+	{
+		std::stringstream err_desc;
+		err_desc << "Compression error " << error << ": " << lodepng_error_text(error);
+		std::string s = err_desc.str();
+		throw std::exception(s.c_str());
+	}
+	if (compressed.size() >= size)
+	{
+		std::vector<unsigned char>().swap(compressed);
+		return false;
+	}
+	return true;
+}
+
+// Undo compress_text
+// Throws std::exception on error
+void decompress_text(const unsigned char* compressed, size_t size, std::vector<unsigned char>& plaintext)
+{
+	plaintext.clear();
+	unsigned int error = lodepng::decompress(plaintext, compressed, size);
+	if (error)
+	{
+		std::stringstream err_desc;
+		err_desc << "Decompression error " << error << ": " << lodepng_error_text(error);
+		std::string s = err_desc.str();
+		throw std::exception(s.c_str());
+	}
+}
+
+// Lay the text out as a chunked container, chunk_size bytes of text per chunk, each one compressed first
+// if compress is set (and it helps) and then encrypted with key_string, in CTR mode if ctr is set and
+// CFB otherwise
+// Each chunk's IV is payload_iv with the chunk number mixed in (see openssl_aes_chunk_iv)
+// Throws std::exception on error
+void build_chunked_payload(const std::string& key_string, const std::vector<unsigned char>& plaintext,
+	size_t chunk_size, bool compress, bool ctr, const unsigned char* payload_iv, std::vector<unsigned char>& payload)
+{
+	if (chunk_size == 0 || chunk_size > 0xFFFFFFFFu)
+		throw std::exception("Exception in build_chunked_payload: invalid chunk size");
+	size_t chunk_count = (plaintext.size() + chunk_size - 1) / chunk_size;
+	if (chunk_count > 0xFFFFFFFFu)
+		throw std::exception("Exception in build_chunked_payload: too many chunks");
+
+	payload.assign(CONTAINER_HEADER_SIZE + chunk_count * CHUNK_TABLE_ENTRY_SIZE, 0);
+	put_le(&payload[0], chunk_size, 4);
+	put_le(&payload[4], chunk_count, 4);
+	put_le(&payload[8], plaintext.size(), 8);
+
+	std::vector<unsigned char> compressed;
+	for (size_t chunk = 0; chunk < chunk_count; chunk++)
+	{
+		const unsigned char* text = &plaintext[chunk * chunk_size];
+		size_t text_size = plaintext.size() - chunk * chunk_size < chunk_size ? plaintext.size() - chunk * chunk_size : chunk_size;
+
+		unsigned char flags = 0;
+		if (compress && compress_text(text, text_size, compressed))
+			flags |= CHUNK_FLAG_COMPRESSED;
+		const unsigned char* stored = (flags & CHUNK_FLAG_COMPRESSED) ? &compressed[0] : text;
+		size_t stored_size = (flags & CHUNK_FLAG_COMPRESSED) ? compressed.size() : text_size;
+
+		put_le(&payload[CONTAINER_HEADER_SIZE + chunk * CHUNK_TABLE_ENTRY_SIZE], stored_size, 4);
+
+		size_t offset = payload.size();
+		payload.resize(offset + CHUNK_HEADER_SIZE + stored_size, 0);
+		unsigned char* chunk_header = &payload[offset];
+		put_le(chunk_header, chunk, 4);
+		put_le(chunk_header + 4, stored_size, 4);
+		put_le(chunk_header + 8, text_size, 4);
+		chunk_header[12] = flags;
+		openssl_aes_chunk_iv(payload_iv, chunk, chunk_header + CHUNK_IV_OFFSET);
+		if (ctr)
+			openssl_aes_ctr(key_string, chunk_header + CHUNK_IV_OFFSET, stored, chunk_header + CHUNK_HEADER_SIZE,
+				stored_size, 0);
+		else
+			openssl_aes_cfb(key_string, chunk_header + CHUNK_IV_OFFSET, stored, chunk_header + CHUNK_HEADER_SIZE,
+				stored_size, true);
+	}
+}
+
+// The most bytes build_chunked_payload can lay out text_size bytes of text in: chunks that don't compress
+// are stored as they are, so it's the text plus the container's own headers and table
+unsigned long long chunked_payload_bound(unsigned long long text_size, unsigned long long chunk_size)
+{
+	unsigned long long chunk_count = (text_size + chunk_size - 1) / chunk_size;
+	return CONTAINER_HEADER_SIZE + chunk_count * (CHUNK_TABLE_ENTRY_SIZE + CHUNK_HEADER_SIZE) + text_size;
+}
+
+// Read bytes [first, last) of the text out of a chunked container of payload_size bytes, extracting only
+// the container header, the chunk table and the chunks holding those bytes through read
+// last is clipped to the end of the text, and the bytes are appended to plaintext
+// ctr must be set as it was for build_chunked_payload
+// Throws std::exception on error
+void read_chunked_payload(const std::string& key_string, unsigned long long payload_size, const payload_reader& read,
+	unsigned long long first, unsigned long long last, bool ctr, std::vector<unsigned char>& plaintext)
+{
+	if (payload_size < CONTAINER_HEADER_SIZE)
+		throw std::exception("Exception in read_chunked_payload: the container is damaged");
+	unsigned char container_header[CONTAINER_HEADER_SIZE];
+	read(0, CONTAINER_HEADER_SIZE, container_header);
+	unsigned long long chunk_size = get_le(container_header, 4);
+	unsigned long long chunk_count = get_le(container_header + 4, 4);
+	unsigned long long text_size = get_le(container_header + 8, 8);
+	if (chunk_size == 0 || chunk_count != (text_size + chunk_size - 1) / chunk_size ||
+		chunk_count > (payload_size - CONTAINER_HEADER_SIZE) / (CHUNK_TABLE_ENTRY_SIZE + CHUNK_HEADER_SIZE))
+		throw std::exception("Exception in read_chunked_payload: the container is damaged");
+
+	if (last > text_size)
+		last = text_size;
+	if (first >= last)
+		return;
+
+	std::vector<unsigned char> table((size_t)chunk_count * CHUNK_TABLE_ENTRY_SIZE);
+	if (!table.empty())
+		read(CONTAINER_HEADER_SIZE, table.size(), &table[0]);
+
+	// Where each chunk starts comes from adding up the sizes of the ones before it
+	unsigned long long first_chunk = first / chunk_size;
+	unsigned long long last_chunk = (last - 1) / chunk_size;
+	unsigned long long offset = CONTAINER_HEADER_SIZE + table.size();
+	for (unsigned long long chunk = 0; chunk < first_chunk; chunk++)
+		offset += CHUNK_HEADER_SIZE + get_le(&table[(size_t)chunk * CHUNK_TABLE_ENTRY_SIZE], 4);
+
+	std::vector<unsigned char> stored;
+	std::vector<unsigned char> decompressed;
+	for (unsigned long long chunk = first_chunk; chunk <= last_chunk; chunk++)
+	{
+		unsigned long long stored_size = get_le(&table[(size_t)chunk * CHUNK_TABLE_ENTRY_SIZE], 4);
+		unsigned long long expected_text_size = chunk + 1 < chunk_count ? chunk_size : text_size - chunk * chunk_size;
+		if (offset + CHUNK_HEADER_SIZE + stored_size > payload_size)
+			throw std::exception("Exception in read_chunked_payload: the container is damaged");
+
+		unsigned char chunk_header[CHUNK_HEADER_SIZE];
+		read((size_t)offset, CHUNK_HEADER_SIZE, chunk_header);
+		if (get_le(chunk_header, 4) != chunk || get_le(chunk_header + 4, 4) != stored_size ||
+			get_le(chunk_header + 8, 4) != expected_text_size || (chunk_header[12] & ~CHUNK_FLAG_COMPRESSED))
+			throw std::exception("Exception in read_chunked_payload: a chunk header doesn't match the chunk table");
+
+		stored.resize((size_t)stored_size);
+		if (!stored.empty())
+		{
+			read((size_t)offset + CHUNK_HEADER_SIZE, stored.size(), &stored[0]);
+			if (ctr)
+				openssl_aes_ctr(key_string, chunk_header + CHUNK_IV_OFFSET, &stored[0], &stored[0], stored.size(), 0);
+			else
+				openssl_aes_cfb(key_string, chunk_header + CHUNK_IV_OFFSET, &stored[0], &stored[0], stored.size(), false);
+		}
+		if (chunk_header[12] & CHUNK_FLAG_COMPRESSED)
+		{
+			decompress_text(stored.empty() ? NULL : &stored[0], stored.size(), decompressed);
+			stored.swap(decompressed);
+		}
+		if (stored.size() != expected_text_size)
+			throw std::exception("Exception in read_chunked_payload: a chunk decrypted to the wrong size (wrong password?)");
+
+		// Just the part of the chunk inside [first, last)
+		unsigned long long chunk_first = chunk * chunk_size;
+		size_t begin = (size_t)(first > chunk_first ? first - chunk_first : 0);
+		size_t end = (size_t)(last - chunk_first < stored.size() ? last - chunk_first : stored.size());
+		plaintext.insert(plaintext.end(), stored.begin() + begin, stored.begin() + end);
+
+		offset += CHUNK_HEADER_SIZE + stored_size;
+	}
+}
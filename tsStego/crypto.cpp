@@ -7,18 +7,36 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <thread>
+#include <exception>
+#include <mutex>
 #include <openssl/aes.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <openssl/crypto.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 #define IVEC_STRING "o3Fc3WlpA3BdiZbx"
+#define CTR_BYTES_PER_THREAD (1 << 20) // Smallest share of a CTR payload worth starting a thread for
+#define KEY_CACHE_ENTRIES 16 // Key schedules and derived keys kept (see set_piece_key)
+#define KDF_SALT_BYTES 16
+#define KDF_KEY_BYTES 16 // AES-128
 
 // Using openssl-for-windows binaries available here: 
 // https://code.google.com/p/openssl-for-windows/
 
 /* IMPORTANT: For consistency, output vector will be cleared and if this function succeeds, it will
 			contain the number of bytes as found in input (TEST this with various lengths to be sure) */
-void openssl_aes_encrypt(std::string key_string,
-	std::vector<unsigned char>& input,
-	std::vector<unsigned char>& output)
+// Only for payloads embedded before they had their own IV (see openssl_random_iv), which were all
+// encrypted with IVEC_STRING
+void openssl_aes_decrypt(const std::string& key_string, 
+							  std::vector<unsigned char>& input,
+							  std::vector<unsigned char>& output)
 {
 	try
 	{
@@ -26,117 +44,361 @@ void openssl_aes_encrypt(std::string key_string,
 	}
 	catch (...)
 	{
-		std::cout << "Exception caught in openssl_aes_encrypt when attempting to clear the output vector." << std::endl;
+		std::cout << "Exception caught in openssl_aes_decrypt when attempting to clear the output vector." << std::endl;
 		return;
 	}
-	
+
 	try
 	{
-		unsigned int key_string_size_bytes = key_string.size();
+		size_t key_string_size_bytes = key_string.size();
 
-		unsigned char* key_array = new unsigned char[key_string_size_bytes];
-		memset(key_array, 0, key_string_size_bytes);
+		// AES-128 reads 16 bytes of key, so a shorter password is zero padded
+		size_t key_array_size = key_string_size_bytes < 16 ? 16 : key_string_size_bytes;
+		unsigned char* key_array = new unsigned char[key_array_size];
+		memset(key_array, 0, key_array_size);
 		memcpy(key_array, key_string.c_str(), key_string_size_bytes);
-		
-		// TODO: For added security, the initialization vector shouldn't be the 
-		//		same every time. It's okay if it's simple, but I really need to 
-		//		consider embedding the IVEC_STRING somewhere in the cypher result
-		//		so that it can vary with each cypher created. The question is, 
-		//		how best to embed it. 
+
 		unsigned char ivec[] = IVEC_STRING;
 
 		AES_KEY key;
 		AES_set_encrypt_key(key_array, 128, &key);
+		OPENSSL_cleanse(key_array, key_array_size);
+		delete[] key_array;
 		int num = 0;
 
-		unsigned char* input_array = new unsigned char[input.size()];
-		unsigned char* output_array = new unsigned char[input.size()];
-		memset(input_array, 0, input.size());
-		memset(output_array, 0, input.size());
+		// Sizes stay in size_t throughout, so payloads past 4 GB work wherever size_t is 64-bit
+		// The cipher works straight from the input into the output, without any staging copies
+		output.resize(input.size());
+		if (!input.empty())
+			AES_cfb128_encrypt(&input[0], &output[0], input.size(), &key, ivec, &num, AES_DECRYPT);
+		OPENSSL_cleanse(&key, sizeof(key));
+	}
+	catch (...)
+	{
+		std::cout << "Exception caught in openssl_aes_decrypt when attempting to decrypt the input vector." << std::endl;
+	}
+}
 
-		std::vector<unsigned char>::iterator it = input.begin();
-		int i = 0;
 
-		while (it != input.end())
-		{
-			input_array[i] = *it;
-			i++;
-			it++;
-		}
+// Expanded key schedules and derived keys, so that a batch of jobs under the same password sets the key up
+// once rather than for every file (and every chunk)
+// Entries are found by a SHA-256 of what they came from, so the cache never holds a password itself, and
+// are wiped when evicted and at exit (openssl_clear_key_cache). The cache is locked into memory where
+// the OS allows it, so keys aren't written out to swap
+struct key_cache_entry
+{
+	unsigned char source_hash[SHA256_DIGEST_LENGTH];
+	AES_KEY key; // For a key schedule
+	unsigned char derived_key[KDF_KEY_BYTES]; // For a derived key
+	unsigned long long last_used; // 0 for an empty entry
+};
 
-		AES_cfb128_encrypt(input_array, output_array, input.size(), &key, ivec, &num, AES_ENCRYPT);
-		for (int j = 0; j < input.size(); j++)
-			output.push_back(output_array[j]);
+static key_cache_entry key_cache[KEY_CACHE_ENTRIES];
+static unsigned long long key_cache_clock = 0;
+static bool key_cache_locked = false;
+static std::mutex key_cache_mutex;
 
-		delete input_array;
-		delete output_array;
+// The entry for source_hash, or NULL if there isn't one
+// key_cache_mutex must be held
+static key_cache_entry* lookup_key_cache_entry(const unsigned char* source_hash)
+{
+	for (unsigned int i = 0; i < KEY_CACHE_ENTRIES; i++)
+	{
+		key_cache_entry& entry = key_cache[i];
+		if (entry.last_used && !memcmp(entry.source_hash, source_hash, SHA256_DIGEST_LENGTH))
+		{
+			entry.last_used = ++key_cache_clock;
+			return &entry;
+		}
 	}
-	catch (...)
+	return NULL;
+}
+
+// Find the entry for source_hash, or else wipe the least recently used entry and claim it for source_hash,
+// setting found to false
+// key_cache_mutex must be held
+static key_cache_entry& find_key_cache_entry(const unsigned char* source_hash, bool& found)
+{
+	if (!key_cache_locked)
 	{
-		std::cout << "Exception caught in openssl_aes_encrypt when attempting to encrypt the input vector." << std::endl;
+#ifdef _WIN32
+		VirtualLock(key_cache, sizeof(key_cache));
+#else
+		mlock(key_cache, sizeof(key_cache));
+#endif
+		key_cache_locked = true; // Even if it couldn't be, there's no point asking again
 	}
+
+	key_cache_entry* entry = lookup_key_cache_entry(source_hash);
+	found = entry != NULL;
+	if (found)
+		return *entry;
+
+	key_cache_entry* oldest = &key_cache[0];
+	for (unsigned int i = 0; i < KEY_CACHE_ENTRIES; i++)
+		if (key_cache[i].last_used < oldest->last_used)
+			oldest = &key_cache[i];
+
+	OPENSSL_cleanse(oldest, sizeof(*oldest));
+	memcpy(oldest->source_hash, source_hash, SHA256_DIGEST_LENGTH);
+	oldest->last_used = ++key_cache_clock;
+	found = false;
+	return *oldest;
 }
 
-/* IMPORTANT: For consistency, output vector will be cleared and if this function succeeds, it will
-			contain the number of bytes as found in input (TEST this with various lengths to be sure) */
-void openssl_aes_decrypt(std::string key_string, 
-							  std::vector<unsigned char>& input,
-							  std::vector<unsigned char>& output)
+// The key is the first 16 bytes of key_string, zero padded if it's shorter
+static void set_piece_key(const std::string& key_string, AES_KEY& key)
 {
-	try
+	unsigned char source_hash[SHA256_DIGEST_LENGTH];
+	SHA256_CTX sha;
+	SHA256_Init(&sha);
+	SHA256_Update(&sha, "schedule", 8);
+	SHA256_Update(&sha, key_string.c_str(), key_string.size());
+	SHA256_Final(source_hash, &sha);
+
+	std::lock_guard<std::mutex> lock(key_cache_mutex);
+	bool found;
+	key_cache_entry& entry = find_key_cache_entry(source_hash, found);
+	if (!found)
 	{
-		output.clear();
+		unsigned char key_array[16] = { 0 };
+		memcpy(key_array, key_string.c_str(), key_string.size() < sizeof(key_array) ? key_string.size() : sizeof(key_array));
+		AES_set_encrypt_key(key_array, 128, &entry.key);
+		OPENSSL_cleanse(key_array, sizeof(key_array));
 	}
-	catch (...)
+	key = entry.key;
+	OPENSSL_cleanse(source_hash, sizeof(source_hash));
+}
+
+// PBKDF2-HMAC-SHA256 (RFC 2898) of the password and salt into out_size bytes of out, done here with SHA256_CTX
+// alone because PKCS5_PBKDF2_HMAC, with its choice of digest, only came in OpenSSL 1.0.0 and the Windows
+// build links 0.9.8
+// The HMAC inner and outer hashes are taken through the padded password once, and copied for every round
+static void pbkdf2_hmac_sha256(const std::string& password, const unsigned char* salt, size_t salt_size,
+	unsigned int iterations, unsigned char* out, size_t out_size)
+{
+	unsigned char pad[SHA256_CBLOCK] = { 0 };
+	if (password.size() > sizeof(pad))
+		SHA256((const unsigned char*)password.c_str(), password.size(), pad);
+	else
+		memcpy(pad, password.c_str(), password.size());
+	SHA256_CTX inner, outer, sha;
+	for (unsigned int i = 0; i < sizeof(pad); i++)
+		pad[i] ^= 0x36;
+	SHA256_Init(&inner);
+	SHA256_Update(&inner, pad, sizeof(pad));
+	for (unsigned int i = 0; i < sizeof(pad); i++)
+		pad[i] ^= 0x36 ^ 0x5C;
+	SHA256_Init(&outer);
+	SHA256_Update(&outer, pad, sizeof(pad));
+
+	unsigned char u[SHA256_DIGEST_LENGTH];
+	unsigned char t[SHA256_DIGEST_LENGTH];
+	for (unsigned int block = 1; out_size > 0; block++)
 	{
-		std::cout << "Exception caught in openssl_aes_decrypt when attempting to clear the output vector." << std::endl;
-		return;
+		// U1 = HMAC(password, salt || block), Un = HMAC(password, Un-1), and the block is U1 ^ U2 ^ ...
+		unsigned char block_bytes[4] = { (unsigned char)(block >> 24), (unsigned char)(block >> 16),
+			(unsigned char)(block >> 8), (unsigned char)block };
+		sha = inner;
+		SHA256_Update(&sha, salt, salt_size);
+		SHA256_Update(&sha, block_bytes, sizeof(block_bytes));
+		SHA256_Final(u, &sha);
+		sha = outer;
+		SHA256_Update(&sha, u, sizeof(u));
+		SHA256_Final(u, &sha);
+		memcpy(t, u, sizeof(t));
+		for (unsigned int n = 1; n < iterations; n++)
+		{
+			sha = inner;
+			SHA256_Update(&sha, u, sizeof(u));
+			SHA256_Final(u, &sha);
+			sha = outer;
+			SHA256_Update(&sha, u, sizeof(u));
+			SHA256_Final(u, &sha);
+			for (unsigned int i = 0; i < sizeof(t); i++)
+				t[i] ^= u[i];
+		}
+
+		size_t count = out_size < sizeof(t) ? out_size : sizeof(t);
+		memcpy(out, t, count);
+		out += count;
+		out_size -= count;
 	}
 
-	try
+	OPENSSL_cleanse(pad, sizeof(pad));
+	OPENSSL_cleanse(u, sizeof(u));
+	OPENSSL_cleanse(t, sizeof(t));
+	OPENSSL_cleanse(&inner, sizeof(inner));
+	OPENSSL_cleanse(&outer, sizeof(outer));
+	OPENSSL_cleanse(&sha, sizeof(sha));
+}
+
+// Derive an AES key from a password with PBKDF2-HMAC-SHA256, returned as a key_string for the functions
+// above
+// PBKDF2 is deliberately slow, so derived keys are cached too: a batch whose jobs share a password and
+// salt (see run_batch) pays for it once, and the derivation itself runs without the cache locked, so other
+// jobs' lookups aren't held up behind it
+// The key returned should be wiped (openssl_wipe_key) once it's no longer needed
+std::string openssl_derive_key(const std::string& password, const unsigned char* salt, unsigned int iterations)
+{
+	unsigned char source_hash[SHA256_DIGEST_LENGTH];
+	unsigned char iteration_bytes[4] = { (unsigned char)(iterations >> 24), (unsigned char)(iterations >> 16),
+		(unsigned char)(iterations >> 8), (unsigned char)iterations };
+	SHA256_CTX sha;
+	SHA256_Init(&sha);
+	SHA256_Update(&sha, "pbkdf2", 6);
+	SHA256_Update(&sha, salt, KDF_SALT_BYTES);
+	SHA256_Update(&sha, iteration_bytes, sizeof(iteration_bytes));
+	SHA256_Update(&sha, password.c_str(), password.size());
+	SHA256_Final(source_hash, &sha);
+
+	std::unique_lock<std::mutex> lock(key_cache_mutex);
+	key_cache_entry* cached = lookup_key_cache_entry(source_hash);
+	if (cached)
 	{
-		unsigned int key_string_size_bytes = key_string.size();
+		OPENSSL_cleanse(source_hash, sizeof(source_hash));
+		return std::string((const char*)cached->derived_key, KDF_KEY_BYTES);
+	}
+	lock.unlock();
 
-		unsigned char* key_array = new unsigned char[key_string_size_bytes];
-		memset(key_array, 0, key_string_size_bytes);
-		memcpy(key_array, key_string.c_str(), key_string_size_bytes);
+	unsigned char derived_key[KDF_KEY_BYTES];
+	pbkdf2_hmac_sha256(password, salt, KDF_SALT_BYTES, iterations, derived_key, KDF_KEY_BYTES);
+	std::string key_string((const char*)derived_key, KDF_KEY_BYTES);
 
-		// TODO: For added security, it might make sense to embed the IVEC_STRING
-		//		into the cypher, and then extract it here. Probably some clever
-		//		way to spread the bytes around, or just put them at the beginning
-		//		or end. A random-looking set of 128 bits should be indistinguishable
-		//		from cypher text, but need to read more about the security of this.
-		unsigned char ivec[] = IVEC_STRING;
+	// Another job may have derived the same key meanwhile, in which case it's already there
+	lock.lock();
+	bool found;
+	key_cache_entry& entry = find_key_cache_entry(source_hash, found);
+	if (!found)
+		memcpy(entry.derived_key, derived_key, KDF_KEY_BYTES);
+	OPENSSL_cleanse(derived_key, sizeof(derived_key));
+	OPENSSL_cleanse(source_hash, sizeof(source_hash));
+	return key_string;
+}
 
-		AES_KEY key;
-		AES_set_encrypt_key(key_array, 128, &key);
-		int num = 0;
+// Wipe a key_string (e.g. from openssl_derive_key) before it's let go
+void openssl_wipe_key(std::string& key_string)
+{
+	if (!key_string.empty())
+		OPENSSL_cleanse(&key_string[0], key_string.size());
+}
 
-		unsigned char* input_array = new unsigned char[input.size()];
-		unsigned char* output_array = new unsigned char[input.size()];
-		memset(input_array, 0, input.size());
-		memset(output_array, 0, input.size());
+// A fresh, random salt for the key derivation
+// Throws std::exception if OpenSSL can't gather enough randomness
+void openssl_random_salt(unsigned char* salt)
+{
+	if (RAND_bytes(salt, KDF_SALT_BYTES) != 1)
+		throw std::exception("Exception in openssl_random_salt: no random numbers available");
+}
 
-		std::vector<unsigned char>::iterator it = input.begin();
-		int i = 0;
+// Wipe every cached key schedule and derived key
+void openssl_clear_key_cache()
+{
+	std::lock_guard<std::mutex> lock(key_cache_mutex);
+	OPENSSL_cleanse(key_cache, sizeof(key_cache));
+}
 
-		while (it != input.end())
+// Encrypt or decrypt size bytes of input into output with the given 16-byte initialization vector, for
+// payloads that are encrypted in separate pieces (see container.cpp)
+void openssl_aes_cfb(const std::string& key_string,
+	const unsigned char* iv,
+	const unsigned char* input,
+	unsigned char* output,
+	size_t size,
+	bool encrypt)
+{
+	AES_KEY key;
+	set_piece_key(key_string, key);
+
+	unsigned char ivec[AES_BLOCK_SIZE];
+	memcpy(ivec, iv, AES_BLOCK_SIZE);
+	int num = 0;
+	if (size > 0)
+		AES_cfb128_encrypt(input, output, size, &key, ivec, &num, encrypt ? AES_ENCRYPT : AES_DECRYPT);
+	OPENSSL_cleanse(&key, sizeof(key));
+}
+
+// CTR on one thread: the keystream is AES of the counter block iv + n for the nth block, so any part of it
+// can be made without the rest
+static void aes_ctr_range(const AES_KEY* key, const unsigned char* iv, const unsigned char* input,
+	unsigned char* output, size_t size, unsigned long long offset)
+{
+	unsigned long long block = offset / AES_BLOCK_SIZE;
+	size_t skip = (size_t)(offset % AES_BLOCK_SIZE);
+	unsigned char counter[AES_BLOCK_SIZE];
+	unsigned char keystream[AES_BLOCK_SIZE];
+
+	size_t done = 0;
+	while (done < size)
+	{
+		// counter = iv + block, as a 128-bit big endian number
+		unsigned int carry = 0;
+		for (int i = AES_BLOCK_SIZE - 1; i >= 0; i--)
 		{
-			input_array[i] = *it;
-			i++;
-			it++;
+			unsigned int add = i >= AES_BLOCK_SIZE - 8 ? (unsigned int)((block >> (8 * (AES_BLOCK_SIZE - 1 - i))) & 0xFF) : 0;
+			unsigned int sum = iv[i] + add + carry;
+			counter[i] = (unsigned char)sum;
+			carry = sum >> 8;
 		}
+		AES_encrypt(counter, keystream, key);
 
-		AES_cfb128_encrypt(input_array, output_array, input.size(), &key, ivec, &num, AES_DECRYPT);
-		for (int j = 0; j < input.size(); j++)
-			output.push_back(output_array[j]);
-
-		delete input_array;
-		delete output_array;
+		for (size_t i = skip; i < AES_BLOCK_SIZE && done < size; i++, done++)
+			output[done] = input[done] ^ keystream[i];
+		skip = 0;
+		block++;
 	}
-	catch (...)
+}
+
+// Encrypt or decrypt (they're the same in CTR mode) size bytes of input into output, as the bytes starting
+// offset bytes into the payload whose initial counter block is iv
+// Big inputs are split between threads, as every block of the keystream can be made on its own
+void openssl_aes_ctr(const std::string& key_string,
+	const unsigned char* iv,
+	const unsigned char* input,
+	unsigned char* output,
+	size_t size,
+	unsigned long long offset)
+{
+	AES_KEY key;
+	set_piece_key(key_string, key);
+
+	size_t threads = std::thread::hardware_concurrency();
+	if (threads > size / CTR_BYTES_PER_THREAD)
+		threads = size / CTR_BYTES_PER_THREAD;
+	if (threads < 2)
+		aes_ctr_range(&key, iv, input, output, size, offset);
+	else
 	{
-		std::cout << "Exception caught in openssl_aes_decrypt when attempting to decrypt the input vector." << std::endl;
+		// Split on block boundaries so no two threads make the same keystream block
+		size_t part = (size / threads + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+		std::vector<std::thread> workers;
+		for (size_t start = 0; start < size; start += part)
+		{
+			size_t count = size - start < part ? size - start : part;
+			workers.push_back(std::thread(aes_ctr_range, &key, iv, input + start, output + start, count, offset + start));
+		}
+		for (auto& worker : workers)
+			worker.join();
 	}
+	OPENSSL_cleanse(&key, sizeof(key));
 }
 
+// A fresh, random 16-byte initialization vector for each payload, so that no two payloads encrypted
+// with the same password share a keystream
+// Throws std::exception if OpenSSL can't gather enough randomness
+void openssl_random_iv(unsigned char* iv)
+{
+	if (RAND_bytes(iv, AES_BLOCK_SIZE) != 1)
+		throw std::exception("Exception in openssl_random_iv: no random numbers available");
+}
+
+// The initialization vector for one piece of a payload: the payload's IV with the piece's number mixed
+// into its first 8 bytes, so that no two pieces share a keystream, in CTR mode too where the last 8 bytes
+// count the blocks within the piece
+// A null payload_iv stands for IVEC_STRING, the IV of every payload before they had their own
+void openssl_aes_chunk_iv(const unsigned char* payload_iv, unsigned long long chunk, unsigned char* iv)
+{
+	memcpy(iv, payload_iv ? payload_iv : (const unsigned char*)IVEC_STRING, AES_BLOCK_SIZE);
+	for (unsigned int i = 0; i < 8; i++)
+		iv[7 - i] ^= (unsigned char)(chunk >> (8 * i));
+}
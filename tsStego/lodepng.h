@@ -286,6 +286,7 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  unsigned maxchainlength; /*max hash chain entries tried per position. 0 = windowsize / 8, or windowsize if >= 8192. Default: 0*/
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -655,6 +656,15 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+/*
+Undo the PNG filter of one scanline. scanline is the filtered data without its filter type
+byte, precon the previous unfiltered scanline or NULL for the first one, and bytewidth the
+bytes per complete pixel (1 for less than 8 bits per pixel). recon and scanline may be the
+same buffer. For decoders that inflate parts of the image data themselves.
+*/
+unsigned lodepng_unfilter_scanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                   size_t bytewidth, unsigned char filterType, size_t length);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 
@@ -738,6 +748,16 @@ buffer. It cannot be used to create gzip files however, and it only supports the
 part of zlib that is required for PNG, it does not support dictionaries.
 */
 
+/*Update an Adler-32 checksum with len more bytes. Start with adler = 1 for a new checksum.*/
+unsigned lodepng_adler32_update(unsigned adler, const unsigned char* data, size_t len);
+
+/*
+Given the Adler-32 of two buffers, and the length of the second, return the Adler-32
+of the two buffers one after the other. Lets separately checksummed pieces of a stream,
+e.g. compressed in parallel, be combined into the checksum of the whole stream.
+*/
+unsigned lodepng_adler32_combine(unsigned adler1, unsigned adler2, size_t len2);
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Inflate a buffer. Inflate is the decompression step of deflate. Out buffer must be freed after use.*/
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
@@ -779,6 +799,17 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings);
 
+/*
+Compress a buffer as one part of a larger deflate stream. With last = 0, no block is
+marked final and the part ends with an empty stored block, so it ends on a byte boundary
+(a zlib "full flush"). Parts made this way don't refer back to each other, so they can be
+compressed independently, e.g. in parallel, and concatenated, the final one with last = 1.
+A non-final part can be inflated on its own by appending the bytes 3, 0 (an empty final block).
+*/
+unsigned lodepng_deflate_part(unsigned char** out, size_t* outsize,
+                              const unsigned char* in, size_t insize,
+                              const LodePNGCompressSettings* settings, unsigned last);
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -1161,6 +1192,9 @@ can encode the colors of all pixels without information loss.
    true for proper compression.
 *) windowsize: the window size used by the LZ77 encoder (1 - 32768). Has value
    2048 by default, but can be set to 32768 for better, but slow, compression.
+*) maxchainlength: how many earlier positions with the same hash the LZ77 encoder
+   tries before settling for the best match so far. 0 (default) picks it from
+   the windowsize. Lower is faster, higher compresses better.
 *) force_palette: if colortype is 2 or 6, you can make the encoder write a PLTE
    chunk if force_palette is true. This can used as suggested palette to convert
    to by viewers that don't support more than 256 colors (if those still exist)
@@ -0,0 +1,375 @@
+// parallel_png.cpp
+// Released under the MIT License
+//
+// Segmented PNG encoding and parallel decoding
+//
+// Inflate can't be split up after the fact, since every deflate block may refer back into the one
+// before it. So when asked to, the encoder splits the image data into segments of whole rows and
+// deflates each one on its own: no back references cross a segment boundary, each segment ends on a
+// byte boundary (a full flush, as zlib would call it), and the first row of each segment is filtered
+// without looking at the row above it. The result is still a single ordinary zlib stream that any
+// PNG decoder reads as usual.
+//
+// The segment offsets and starting rows are recorded in a private ancillary chunk, "tsIX", right before
+// IEND. Being unsafe to copy, editors that rewrite the image data will drop it. When our decoder finds
+// the chunk it inflates and unfilters the segments on separate threads.
+//
+// tsIX chunk data, all integers big endian:
+//		1 byte version (1)
+//		4 byte segment count
+//		then for each segment, 4 byte offset into the zlib stream (the concatenated IDAT data) and
+//		4 byte first row
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include "lodepng.h"
+
+#define TSIX_CHUNK_TYPE "tsIX"
+#define TSIX_VERSION 1
+#define TSIX_MAX_SEGMENTS 256
+
+// Returned by a segment that doesn't match the index (or doesn't inflate or unfilter), to fall back to a
+// regular decode
+#define SEGMENT_NOT_INDEXED 0xFFFFFFFF
+
+struct png_segment
+{
+	unsigned int offset; // Offset of the segment in the zlib stream
+	unsigned int first_row;
+};
+
+// What segmented_zlib_compress needs besides the filtered data lodepng hands it
+struct segmented_zlib_context
+{
+	const unsigned char* image; // The unfiltered image, to refilter the first row of each segment
+	unsigned int width;
+	unsigned int height;
+	unsigned int bpp; // Bits per pixel
+	unsigned int segments; // Requested number of segments
+	std::vector<png_segment>* index; // Filled in with the segments actually written
+};
+
+static unsigned int read_be32(const unsigned char* p)
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static void write_be32(unsigned char* p, unsigned int value)
+{
+	p[0] = (unsigned char)(value >> 24);
+	p[1] = (unsigned char)(value >> 16);
+	p[2] = (unsigned char)(value >> 8);
+	p[3] = (unsigned char)value;
+}
+
+// Run task(0) .. task(count - 1) over as many threads as there are cores, stopping at the first error
+// Returns the error of the lowest numbered failing task, or 0
+template <typename Task>
+static unsigned int run_segments_in_parallel(size_t count, Task task)
+{
+	std::vector<unsigned int> errors(count, 0);
+	std::atomic<size_t> next(0);
+	std::atomic<bool> failed(false);
+
+	auto worker = [&]()
+	{
+		size_t i;
+		while (!failed && (i = next++) < count)
+		{
+			try
+			{
+				errors[i] = task(i);
+			}
+			catch (...)
+			{
+				errors[i] = 83; // lodepng's "memory allocation failed"
+			}
+			if (errors[i])
+				failed = true;
+		}
+	};
+
+	size_t thread_count = std::thread::hardware_concurrency();
+	if (thread_count == 0)
+		thread_count = 1;
+	if (thread_count > count)
+		thread_count = count;
+
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < thread_count; t++)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (auto& thread : threads)
+		thread.join();
+
+	for (auto error : errors)
+		if (error)
+			return error;
+	return 0;
+}
+
+// A custom_zlib for lodepng's encoder that writes the zlib stream as independent segments
+// settings->custom_context points to a segmented_zlib_context
+static unsigned segmented_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize,
+	const LodePNGCompressSettings* settings)
+{
+	const segmented_zlib_context& context = *(const segmented_zlib_context*)settings->custom_context;
+	LodePNGCompressSettings part_settings = *settings;
+	part_settings.custom_zlib = 0;
+	part_settings.custom_context = 0;
+
+	const size_t line_bytes = ((size_t)context.width * context.bpp + 7) / 8;
+	const size_t row_bytes = line_bytes + 1; // Each row starts with its filter type
+	const size_t byte_width = (context.bpp + 7) / 8;
+
+	context.index->clear();
+	if (insize != row_bytes * context.height || context.height == 0)
+		return lodepng_zlib_compress(out, outsize, in, insize, &part_settings); // Not our image, don't index it
+
+	const unsigned int rows_per_segment = (context.height + context.segments - 1) / context.segments;
+	const unsigned int segment_count = (context.height + rows_per_segment - 1) / rows_per_segment;
+
+	std::vector<std::vector<unsigned char>> deflated(segment_count);
+	std::vector<unsigned int> adlers(segment_count);
+	std::vector<size_t> sizes(segment_count);
+
+	unsigned int error = run_segments_in_parallel(segment_count, [&](size_t k) -> unsigned int
+	{
+		unsigned int first_row = (unsigned int)k * rows_per_segment;
+		unsigned int end_row = first_row + rows_per_segment < context.height ? first_row + rows_per_segment : context.height;
+		const unsigned char* data = &in[first_row * row_bytes];
+		size_t size = (end_row - first_row) * row_bytes;
+
+		// Up and the filters after it look at the row above, which belongs to the previous segment, so
+		// refilter the first row with Sub instead
+		std::vector<unsigned char> refiltered;
+		if (k > 0 && data[0] > 1)
+		{
+			refiltered.assign(data, data + size);
+			const unsigned char* raw = &context.image[first_row * line_bytes];
+			refiltered[0] = 1;
+			for (size_t i = 0; i < byte_width; i++)
+				refiltered[1 + i] = raw[i];
+			for (size_t i = byte_width; i < line_bytes; i++)
+				refiltered[1 + i] = raw[i] - raw[i - byte_width];
+			data = &refiltered[0];
+		}
+
+		unsigned char* part = 0;
+		size_t part_size = 0;
+		unsigned int part_error = lodepng_deflate_part(&part, &part_size, data, size, &part_settings,
+			k == segment_count - 1);
+		if (!part_error)
+			deflated[k].assign(part, part + part_size);
+		free(part);
+
+		adlers[k] = lodepng_adler32_update(1, data, size);
+		sizes[k] = size;
+		return part_error;
+	});
+	if (error)
+		return error;
+
+	// zlib header (deflate, 32K window, no preset dictionary, same as lodepng's), the segments, and the
+	// Adler-32 of the whole image data pieced together from the segments'
+	std::vector<unsigned char> zlib;
+	zlib.push_back(0x78);
+	zlib.push_back(0x01);
+	unsigned int adler = adlers[0];
+	for (unsigned int k = 0; k < segment_count; k++)
+	{
+		png_segment segment = { (unsigned int)zlib.size(), k * rows_per_segment };
+		context.index->push_back(segment);
+		zlib.insert(zlib.end(), deflated[k].begin(), deflated[k].end());
+		if (k > 0)
+			adler = lodepng_adler32_combine(adler, adlers[k], sizes[k]);
+	}
+	zlib.resize(zlib.size() + 4);
+	write_be32(&zlib[zlib.size() - 4], adler);
+
+	*out = (unsigned char*)malloc(zlib.size());
+	if (!*out)
+		return 83;
+	memcpy(*out, &zlib[0], zlib.size());
+	*outsize = zlib.size();
+	return 0;
+}
+
+// Encode the image as a PNG of independently deflated segments, indexed by a tsIX chunk
+// Meant for images encoded in their own color type (state.encoder.auto_convert off), non-interlaced
+// Returns a lodepng error code
+unsigned int encode_segmented_png(std::vector<unsigned char>& png, const unsigned char* image,
+	unsigned int width, unsigned int height, lodepng::State& state, unsigned int segments)
+{
+	if (segments > TSIX_MAX_SEGMENTS)
+		segments = TSIX_MAX_SEGMENTS;
+
+	std::vector<png_segment> index;
+	segmented_zlib_context context = { image, width, height, lodepng_get_bpp(&state.info_raw), segments, &index };
+
+	LodePNGCompressSettings saved_settings = state.encoder.zlibsettings;
+	state.encoder.zlibsettings.custom_zlib = segmented_zlib_compress;
+	state.encoder.zlibsettings.custom_context = &context;
+	unsigned int error = lodepng::encode(png, image, width, height, state);
+	state.encoder.zlibsettings = saved_settings;
+
+	if (error || index.empty())
+		return error;
+	if (png.size() < 12 || !lodepng_chunk_type_equals(&png[png.size() - 12], "IEND"))
+		return 0; // Nowhere to put the index, but the PNG itself is fine
+
+	std::vector<unsigned char> index_data(5 + 8 * index.size());
+	index_data[0] = TSIX_VERSION;
+	write_be32(&index_data[1], (unsigned int)index.size());
+	for (size_t k = 0; k < index.size(); k++)
+	{
+		write_be32(&index_data[5 + 8 * k], index[k].offset);
+		write_be32(&index_data[9 + 8 * k], index[k].first_row);
+	}
+
+	unsigned char* chunk = 0;
+	size_t chunk_size = 0;
+	error = lodepng_chunk_create(&chunk, &chunk_size, (unsigned int)index_data.size(), TSIX_CHUNK_TYPE, &index_data[0]);
+	if (!error)
+		png.insert(png.end() - 12, chunk, chunk + chunk_size);
+	free(chunk);
+	return error;
+}
+
+// Decode a PNG written by encode_segmented_png, inflating and unfiltering its segments in parallel
+// The image is decoded in its own color type, which must be what's in state.info_raw, and the usual
+// CRC and Adler-32 checks apply unless the state's decoder settings turn them off
+// Sets decoded to false, without an error, for a PNG that has no usable index or otherwise needs
+// lodepng's regular decoder, including one whose segments don't inflate, unfilter or add up to the
+// Adler-32 the way the index says they should (lodepng then reports any real damage itself)
+// Images under 8 bits per pixel are left to lodepng too, as its rows for those aren't padded to whole bytes
+// Returns a lodepng error code
+unsigned int decode_segmented_png(std::vector<unsigned char>& image, unsigned int width, unsigned int height,
+	lodepng::State& state, const std::vector<unsigned char>& png, bool& decoded)
+{
+	decoded = false;
+	if (state.info_png.interlace_method != 0 || png.size() < 8 + 25 + 12 || height == 0 ||
+		state.info_raw.colortype != state.info_png.color.colortype ||
+		state.info_raw.bitdepth != state.info_png.color.bitdepth || lodepng_get_bpp(&state.info_raw) < 8)
+		return 0;
+
+	// Gather the image data and the index
+	std::vector<unsigned char> idat;
+	std::vector<png_segment> index;
+	const unsigned char* chunk = &png[8];
+	const unsigned char* end = &png[0] + png.size();
+	while (chunk + 12 <= end)
+	{
+		unsigned int length = lodepng_chunk_length(chunk);
+		if (length > (size_t)(end - chunk) - 12)
+			return 0;
+		if (!state.decoder.ignore_crc && lodepng_chunk_check_crc(chunk))
+			return 57; // lodepng's "invalid CRC"
+
+		const unsigned char* data = lodepng_chunk_data_const(chunk);
+		if (lodepng_chunk_type_equals(chunk, "IDAT"))
+			idat.insert(idat.end(), data, data + length);
+		else if (lodepng_chunk_type_equals(chunk, TSIX_CHUNK_TYPE))
+		{
+			if (length < 5 || data[0] != TSIX_VERSION || read_be32(&data[1]) > TSIX_MAX_SEGMENTS ||
+				length != 5 + 8 * read_be32(&data[1]))
+				return 0;
+			index.resize(read_be32(&data[1]));
+			for (size_t k = 0; k < index.size(); k++)
+			{
+				index[k].offset = read_be32(&data[5 + 8 * k]);
+				index[k].first_row = read_be32(&data[9 + 8 * k]);
+			}
+		}
+		else if (lodepng_chunk_type_equals(chunk, "IEND"))
+			break;
+		else if (!lodepng_chunk_ancillary(chunk) && !lodepng_chunk_type_equals(chunk, "IHDR") &&
+			!lodepng_chunk_type_equals(chunk, "PLTE"))
+			return 0; // An unknown critical chunk, let lodepng report it
+		chunk = lodepng_chunk_next_const(chunk);
+	}
+
+	// The index has to describe this zlib stream exactly, or we leave it all to lodepng
+	if (index.empty() || idat.size() < 2 + 4 || (idat[0] & 15) != 8 || (idat[0] >> 4) > 7 || (idat[1] & 32) ||
+		(idat[0] * 256 + idat[1]) % 31 != 0)
+		return 0;
+	const size_t stream_end = idat.size() - 4; // Before the Adler-32
+	for (size_t k = 0; k < index.size(); k++)
+	{
+		bool first = k == 0;
+		if (first ? index[k].offset != 2 || index[k].first_row != 0 :
+			index[k].offset <= index[k - 1].offset || index[k].first_row <= index[k - 1].first_row)
+			return 0;
+		if (index[k].offset >= stream_end || index[k].first_row >= height)
+			return 0;
+	}
+
+	const size_t line_bytes = ((size_t)width * lodepng_get_bpp(&state.info_raw) + 7) / 8;
+	const size_t row_bytes = line_bytes + 1;
+	const size_t byte_width = (lodepng_get_bpp(&state.info_raw) + 7) / 8;
+	image.resize(line_bytes * height);
+
+	std::vector<unsigned int> adlers(index.size());
+	std::vector<size_t> sizes(index.size());
+	unsigned int error = run_segments_in_parallel(index.size(), [&](size_t k) -> unsigned int
+	{
+		bool last = k == index.size() - 1;
+		unsigned int first_row = index[k].first_row;
+		unsigned int end_row = last ? height : index[k + 1].first_row;
+
+		// All but the last segment end in an empty stored block instead of a final one, so finish them off
+		// with an empty final block (fixed Huffman, end of block code only)
+		std::vector<unsigned char> deflated(idat.begin() + index[k].offset, idat.begin() + (last ? stream_end : index[k + 1].offset));
+		if (!last)
+		{
+			deflated.push_back(0x03);
+			deflated.push_back(0x00);
+		}
+
+		unsigned char* inflated = 0;
+		size_t inflated_size = 0;
+		unsigned int part_error = lodepng_inflate(&inflated, &inflated_size, &deflated[0], deflated.size(),
+			&state.decoder.zlibsettings);
+		if (part_error || inflated_size != (end_row - first_row) * row_bytes || (k > 0 && inflated[0] > 1))
+			part_error = SEGMENT_NOT_INDEXED;
+
+		for (unsigned int y = first_row; y < end_row && !part_error; y++)
+		{
+			const unsigned char* scanline = &inflated[(y - first_row) * row_bytes];
+			const unsigned char* precon = y == first_row ? 0 : &image[(y - 1) * line_bytes];
+			part_error = lodepng_unfilter_scanline(&image[y * line_bytes], scanline + 1, precon, byte_width,
+				scanline[0], line_bytes);
+		}
+		if (part_error)
+			part_error = SEGMENT_NOT_INDEXED;
+
+		if (!part_error && !state.decoder.zlibsettings.ignore_adler32)
+			adlers[k] = lodepng_adler32_update(1, inflated, inflated_size);
+		sizes[k] = inflated_size;
+		free(inflated);
+		return part_error;
+	});
+	if (error)
+	{
+		image.clear(); // lodepng::decode appends to it
+		return 0; // Always SEGMENT_NOT_INDEXED
+	}
+
+	if (!state.decoder.zlibsettings.ignore_adler32)
+	{
+		unsigned int adler = adlers[0];
+		for (size_t k = 1; k < index.size(); k++)
+			adler = lodepng_adler32_combine(adler, adlers[k], sizes[k]);
+		if (adler != read_be32(&idat[stream_end]))
+		{
+			image.clear();
+			return 0; // Maybe the index is wrong rather than the data, which lodepng's own check will tell
+		}
+	}
+
+	decoded = true;
+	return 0;
+}
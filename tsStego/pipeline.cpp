@@ -0,0 +1,292 @@
+// pipeline.cpp
+// Released under the MIT License
+//
+// A staged job pipeline: each stage has its own threads, and the stages are connected by bounded
+// lock-free queues of job numbers, so a slow stage holds back the ones before it instead of letting jobs
+// (and their memory) pile up in front of it
+//
+// To help decide how many threads each stage deserves, run_pipeline reports for every stage how much of
+// its threads' time went to work, to waiting for jobs from the stage before, and to waiting for room in
+// the queue to the stage after, along with the average and largest depth of its input queue
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include "pipeline.h"
+
+#define END_OF_JOBS ((size_t)-1) // Sent down a queue once per thread of the next stage when the jobs run out
+
+// A bounded multi-producer, multi-consumer queue that never takes a lock (Dmitry Vyukov's design)
+// Each cell carries a sequence number saying whether it's ready to be written or read on the current
+// lap around the ring, so producers and consumers only ever contend on their own position counter
+template <typename T>
+class bounded_queue
+{
+	struct cell
+	{
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<cell[]> cells;
+	size_t mask;
+	char pad0[64];
+	std::atomic<size_t> enqueue_pos;
+	char pad1[64];
+	std::atomic<size_t> dequeue_pos;
+	char pad2[64];
+
+public:
+	// capacity is rounded up to a power of two
+	explicit bounded_queue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size *= 2;
+		cells.reset(new cell[size]);
+		mask = size - 1;
+		for (size_t i = 0; i < size; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		enqueue_pos.store(0, std::memory_order_relaxed);
+		dequeue_pos.store(0, std::memory_order_relaxed);
+	}
+
+	bool try_push(const T& data)
+	{
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell* c = &cells[pos & mask];
+			size_t sequence = c->sequence.load(std::memory_order_acquire);
+			if (sequence == pos)
+			{
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					c->data = data;
+					c->sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (sequence < pos)
+				return false; // Full
+			else
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	bool try_pop(T& data)
+	{
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell* c = &cells[pos & mask];
+			size_t sequence = c->sequence.load(std::memory_order_acquire);
+			if (sequence == pos + 1)
+			{
+				if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					data = c->data;
+					c->sequence.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (sequence < pos + 1)
+				return false; // Empty
+			else
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	// Roughly how many items are waiting, exact when nothing else is pushing or popping
+	size_t size() const
+	{
+		size_t head = dequeue_pos.load(std::memory_order_relaxed);
+		size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+		return tail > head ? tail - head : 0;
+	}
+};
+
+// Spin briefly, then yield, then sleep, for a stage waiting on a queue
+static void back_off(unsigned int& attempts)
+{
+	attempts++;
+	if (attempts < 64)
+		return;
+	if (attempts < 128)
+		std::this_thread::yield();
+	else
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+typedef std::chrono::steady_clock pipeline_clock;
+
+static double seconds_since(pipeline_clock::time_point start)
+{
+	return std::chrono::duration<double>(pipeline_clock::now() - start).count();
+}
+
+// Time spent by all the threads of one stage
+struct stage_stats
+{
+	std::atomic<long long> busy_us;
+	std::atomic<long long> input_wait_us;
+	std::atomic<long long> output_wait_us;
+	std::atomic<long long> depth_total; // Input queue depth summed over every push into it
+	std::atomic<long long> depth_samples;
+	std::atomic<long long> depth_max;
+};
+
+static void add_seconds(std::atomic<long long>& total_us, double seconds)
+{
+	total_us += (long long)(seconds * 1000000.0);
+}
+
+void run_pipeline(std::vector<pipeline_stage>& stages, size_t job_count, size_t queue_depth)
+{
+	const size_t stage_count = stages.size();
+	if (stage_count == 0)
+		return;
+
+	std::vector<unsigned int> threads(stage_count);
+	std::unique_ptr<stage_stats[]> stats(new stage_stats[stage_count]);
+	std::unique_ptr<std::atomic<unsigned int>[]> running(new std::atomic<unsigned int>[stage_count]);
+	std::vector<std::unique_ptr<bounded_queue<size_t>>> queues(stage_count); // queues[s] feeds stage s
+	for (size_t s = 0; s < stage_count; s++)
+	{
+		threads[s] = (s == 0 || stages[s].ordered || stages[s].threads == 0) ? 1 : stages[s].threads;
+		running[s] = threads[s];
+		stats[s].busy_us = 0;
+		stats[s].input_wait_us = 0;
+		stats[s].output_wait_us = 0;
+		stats[s].depth_total = 0;
+		stats[s].depth_samples = 0;
+		stats[s].depth_max = 0;
+		if (s > 0)
+			queues[s].reset(new bounded_queue<size_t>(queue_depth > threads[s] ? queue_depth : threads[s]));
+	}
+
+	// Hand a job (or END_OF_JOBS) on from stage s to stage s + 1
+	auto forward = [&](size_t s, size_t job)
+	{
+		if (s + 1 == stage_count)
+			return;
+		pipeline_clock::time_point start = pipeline_clock::now();
+		unsigned int attempts = 0;
+		while (!queues[s + 1]->try_push(job))
+			back_off(attempts);
+		add_seconds(stats[s].output_wait_us, seconds_since(start));
+		if (job == END_OF_JOBS)
+			return;
+
+		long long depth = (long long)queues[s + 1]->size();
+		stats[s + 1].depth_total += depth;
+		stats[s + 1].depth_samples++;
+		long long deepest = stats[s + 1].depth_max;
+		while (depth > deepest && !stats[s + 1].depth_max.compare_exchange_weak(deepest, depth))
+			;
+	};
+
+	auto run_job = [&](size_t s, size_t job)
+	{
+		pipeline_clock::time_point start = pipeline_clock::now();
+		stages[s].run(job);
+		add_seconds(stats[s].busy_us, seconds_since(start));
+		forward(s, job);
+	};
+
+	// The last thread of a stage to finish tells every thread of the next stage there's nothing more coming
+	auto finish_thread = [&](size_t s)
+	{
+		if (--running[s] == 0)
+			for (unsigned int t = 0; s + 1 < stage_count && t < threads[s + 1]; t++)
+				forward(s, END_OF_JOBS);
+	};
+
+	auto stage_thread = [&](size_t s)
+	{
+		if (s == 0)
+		{
+			for (size_t job = 0; job < job_count; job++)
+			{
+				if (stages[0].ready)
+				{
+					// Counted as waiting for input, as it's usually a job waiting on another one's output
+					pipeline_clock::time_point start = pipeline_clock::now();
+					unsigned int attempts = 0;
+					while (!stages[0].ready(job))
+						back_off(attempts);
+					add_seconds(stats[0].input_wait_us, seconds_since(start));
+				}
+				run_job(0, job);
+			}
+			finish_thread(0);
+			return;
+		}
+
+		std::map<size_t, bool> early; // Ordered stages only: jobs that arrived before their turn
+		size_t next_job = 0;
+		for (;;)
+		{
+			size_t job;
+			pipeline_clock::time_point start = pipeline_clock::now();
+			unsigned int attempts = 0;
+			while (!queues[s]->try_pop(job))
+				back_off(attempts);
+			add_seconds(stats[s].input_wait_us, seconds_since(start));
+			if (job == END_OF_JOBS)
+				break;
+
+			if (!stages[s].ordered)
+			{
+				run_job(s, job);
+				continue;
+			}
+			early[job] = true;
+			while (!early.empty() && early.begin()->first == next_job)
+			{
+				early.erase(early.begin());
+				run_job(s, next_job++);
+			}
+		}
+		finish_thread(s);
+	};
+
+	pipeline_clock::time_point start = pipeline_clock::now();
+	std::vector<std::thread> workers;
+	for (size_t s = 0; s < stage_count; s++)
+		for (unsigned int t = 0; t < threads[s]; t++)
+			workers.push_back(std::thread(stage_thread, s));
+	for (auto& worker : workers)
+		worker.join();
+	double wall = seconds_since(start);
+
+	std::cout << std::endl;
+	std::cout << "Pipeline: " << job_count << " jobs in " << std::fixed << std::setprecision(2) << wall << " s" << std::endl;
+	std::cout << "  stage      threads   busy   idle   blocked   queue avg   max" << std::endl;
+	for (size_t s = 0; s < stage_count; s++)
+	{
+		// As shares of the time the stage's threads were around for
+		double thread_us = wall * 1000000.0 * threads[s];
+		if (thread_us <= 0)
+			thread_us = 1;
+		std::cout << "  " << std::left << std::setw(10) << stages[s].name << std::right;
+		std::cout << std::setw(8) << threads[s];
+		std::cout << std::setprecision(0);
+		std::cout << std::setw(6) << 100.0 * stats[s].busy_us / thread_us << "%";
+		std::cout << std::setw(6) << 100.0 * stats[s].input_wait_us / thread_us << "%";
+		std::cout << std::setw(9) << 100.0 * stats[s].output_wait_us / thread_us << "%";
+		std::cout << std::setprecision(1);
+		if (s == 0)
+			std::cout << std::setw(12) << "-" << std::setw(6) << "-" << std::endl;
+		else
+			std::cout << std::setw(12) << (stats[s].depth_samples ? (double)stats[s].depth_total / stats[s].depth_samples : 0.0)
+				<< std::setw(6) << stats[s].depth_max << std::endl;
+	}
+	std::cout.unsetf(std::ios::floatfield);
+	std::cout << std::setprecision(6);
+}
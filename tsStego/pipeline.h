@@ -0,0 +1,31 @@
+// pipeline.h
+// Released under the MIT License
+//
+// Runs a list of jobs through a series of stages, each on its own threads, so that different jobs can be
+// in different stages at once (e.g. decoding job N + 1 while job N is being compressed)
+// See pipeline.cpp
+
+#ifndef TSSTEGO_PIPELINE_H
+#define TSSTEGO_PIPELINE_H
+
+#include <string>
+#include <vector>
+#include <functional>
+
+struct pipeline_stage
+{
+	std::string name;
+	unsigned int threads; // The first stage and ordered stages always get one
+	bool ordered; // Whether jobs must reach this stage in order, even if an earlier stage finishes them out of order
+	std::function<void(size_t job)> run; // Do this stage's work on the job with the given number
+	std::function<bool(size_t job)> ready; // Optional, first stage only: whether the job can start yet
+
+	pipeline_stage() : threads(1), ordered(false) {}
+};
+
+// Run jobs 0 to job_count - 1 through the stages, with at most queue_depth jobs waiting between two stages
+// The first stage is handed the jobs in order, and each stage runs a job after the one before it has
+// Prints how busy each stage was and how full its queue got
+void run_pipeline(std::vector<pipeline_stage>& stages, size_t job_count, size_t queue_depth);
+
+#endif // TSSTEGO_PIPELINE_H
@@ -9,7 +9,15 @@
 #include <iostream>
 #include <map>
 #include <exception>
+#include <future>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <climits>
 #include "lodepng.h"
+#include "pipeline.h"
+#include "carriers.h"
 
 #define STEGO_VERSION_STRING "0.2.1"
 
@@ -27,28 +35,136 @@
 #define MAP_CIPHER_IMAGE_FILENAME 0x20
 #define MAP_PASSWORD_STRING 0x40
 
+#define MAP_COMPRESSION_LEVEL 0x80
+#define MAP_COMPRESSION_LEVEL_OPT "--level"
+
+#define MAP_TRUSTED_INPUT 0x100
+#define MAP_TRUSTED_INPUT_OPT "--trusted-input"
+
+#define MAP_SEGMENTS 0x200
+#define MAP_SEGMENTS_OPT "--segments"
+
+#define MAP_JOB_FILENAME 0x400
+#define MAP_BATCH_OPERATION_NAME "batch"
+#define MAP_SHARD_OPERATION_NAME "shard"
+#define MAP_UNSHARD_OPERATION_NAME "unshard"
+#define BATCH_PREFETCH_JOBS 4 // How many jobs ahead to read input files
+#define BATCH_QUEUE_DEPTH 4 // Jobs waiting between two stages of the batch pipeline
+
+#define MAP_STAGE_THREADS 0x800
+#define MAP_STAGE_THREADS_OPT "--stage-threads"
+
+#define MAP_MEM_BUDGET 0x1000
+#define MAP_MEM_BUDGET_OPT "--mem-budget"
+
+#define PAYLOAD_MAGIC "tsSg" // Starts the header embedded ahead of the text (see payload_header)
+#define PAYLOAD_VERSION 1
+#define PAYLOAD_HEADER_SIZE 69 // Bytes in a header of the current version
+#define PAYLOAD_MIN_HEADER_SIZE 16 // Bytes in the smallest header, which has the fields up to the length
+#define PAYLOAD_FLAG_ALPHA 0x1 // The text also uses the alpha channel
+#define PAYLOAD_FLAG_DENSITY 0x2 // The text uses bits_per_slot bits of every slot rather than the 3-2-3 split
+#define PAYLOAD_FLAG_COMPRESSED 0x4 // The text was zlib compressed before it was encrypted
+#define PAYLOAD_FLAG_CHUNKED 0x8 // The text is in a chunked container (see container.cpp)
+#define PAYLOAD_FLAG_CTR 0x10 // Encrypted in CTR mode rather than CFB
+#define PAYLOAD_FLAG_IV 0x20 // The text was encrypted with the IV in the header, not the fixed one
+#define PAYLOAD_FLAG_KDF 0x40 // The key was derived from the password with the salt and iterations in the header
+#define PAYLOAD_FLAG_SHARD 0x80 // The text is one shard of a payload spread across several images (see run_shard)
+#define PAYLOAD_KNOWN_FLAGS 0xFF // Payloads with any other flag set can't be read by this version
+#define LEGACY_HEADER_SIZE 4
+#define KDF_SALT_BYTES 16
+#define KDF_ITERATIONS 100000 // PBKDF2 iterations for a new payload
+#define KDF_MAX_ITERATIONS 10000000 // Any more in a header is taken as damage rather than a minute-long derivation
+
+#define MAP_DENSITY 0x2000
+#define MAP_DENSITY_OPT "--density"
+#define MAX_BITS_PER_SLOT 4
+
+#define MAP_USE_ALPHA 0x4000
+#define MAP_USE_ALPHA_OPT "--use-alpha"
+
+#define MAP_COMPRESS_TEXT 0x8000
+#define MAP_COMPRESS_TEXT_OPT "--compress-text"
+
+#define MAP_CHUNK_SIZE 0x10000
+#define MAP_CHUNK_SIZE_OPT "--chunk-size"
+
+#define MAP_RANGE 0x20000
+#define MAP_RANGE_OPT "--range"
+
+#define MAP_CIPHER 0x40000
+#define MAP_CIPHER_OPT "--cipher"
+#define CIPHER_CFB "cfb"
+#define CIPHER_CTR "ctr"
+
+#define MAP_CARRIER_POOL 0x80000
+#define MAP_CARRIER_POOL_OPT "--carrier-pool"
+
+#define STDIO_FILENAME "-" // Stands for stdin or stdout in place of a file (see async_io.cpp)
+
+#define COMPRESSION_LEVEL_STORE "store"
+#define COMPRESSION_LEVEL_FAST "fast"
+#define COMPRESSION_LEVEL_DEFAULT "default"
+#define COMPRESSION_LEVEL_MAX "max"
+#define COMPRESSION_LEVEL_AUTO "auto"
+#define COMPRESSION_AUTO_DEFAULT_BUDGET_MS 250.0 // Per megapixel
+
 void display_usage_info();
 
 // From crypto.cpp:
-void openssl_aes_encrypt(std::string key_string,
-	std::vector<unsigned char>& input,
-	std::vector<unsigned char>& output);
-void openssl_aes_decrypt(std::string key_string,
+void openssl_aes_decrypt(const std::string& key_string,
 	std::vector<unsigned char>& input,
 	std::vector<unsigned char>& output);
+void openssl_aes_ctr(const std::string& key_string, const unsigned char* iv, const unsigned char* input,
+	unsigned char* output, size_t size, unsigned long long offset);
+void openssl_aes_cfb(const std::string& key_string, const unsigned char* iv, const unsigned char* input,
+	unsigned char* output, size_t size, bool encrypt);
+void openssl_random_iv(unsigned char* iv);
+std::string openssl_derive_key(const std::string& password, const unsigned char* salt, unsigned int iterations);
+void openssl_wipe_key(std::string& key_string);
+void openssl_random_salt(unsigned char* salt);
+void openssl_aes_chunk_iv(const unsigned char* payload_iv, unsigned long long chunk, unsigned char* iv);
+void openssl_clear_key_cache();
+
+// From container.cpp:
+typedef std::function<void(size_t offset, size_t count, unsigned char* bytes)> payload_reader;
+bool compress_text(const unsigned char* plaintext, size_t size, std::vector<unsigned char>& compressed);
+void decompress_text(const unsigned char* compressed, size_t size, std::vector<unsigned char>& plaintext);
+void build_chunked_payload(const std::string& key_string, const std::vector<unsigned char>& plaintext,
+	size_t chunk_size, bool compress, bool ctr, const unsigned char* payload_iv, std::vector<unsigned char>& payload);
+void read_chunked_payload(const std::string& key_string, unsigned long long payload_size, const payload_reader& read,
+	unsigned long long first, unsigned long long last, bool ctr, std::vector<unsigned char>& plaintext);
+unsigned long long chunked_payload_bound(unsigned long long text_size, unsigned long long chunk_size);
+
+// From parallel_png.cpp:
+unsigned int encode_segmented_png(std::vector<unsigned char>& png, const unsigned char* image,
+	unsigned int width, unsigned int height, lodepng::State& state, unsigned int segments);
+unsigned int decode_segmented_png(std::vector<unsigned char>& image, unsigned int width, unsigned int height,
+	lodepng::State& state, const std::vector<unsigned char>& png, bool& decoded);
+
+// From async_io.cpp:
+void async_io_prefetch(const std::string& filename);
+void async_io_cancel_prefetch(const std::string& filename);
+std::vector<unsigned char> async_io_read(const std::string& filename);
+std::vector<unsigned char> async_io_peek(const std::string& filename, size_t size);
+std::shared_future<void> async_io_write(const std::string& filename, std::vector<unsigned char>& data);
+void async_io_drain();
+const char* async_io_backend_name();
 
 // Read the plain text file in
+// Text files are read and written in text mode, as they always have been: on Windows CRLF becomes LF
+// and a Ctrl-Z ends the file
 void read_text_file(const char* filename, std::vector<unsigned char>& plaintext)
 {
 	try
 	{
-		std::fstream text_file(filename);
-		while (text_file.good())
-		{
-			unsigned char c = text_file.get();
-			if (text_file.good())
-				plaintext.push_back(c);
-		}
+		std::vector<unsigned char> text_file = async_io_read(filename);
+#ifdef _WIN32
+		for (size_t i = 0; i < text_file.size() && text_file[i] != 0x1A; i++)
+			if (text_file[i] != '\r' || i + 1 == text_file.size() || text_file[i + 1] != '\n')
+				plaintext.push_back(text_file[i]);
+#else
+		plaintext.insert(plaintext.end(), text_file.begin(), text_file.end());
+#endif
 	}
 	catch (...)
 	{
@@ -57,36 +173,267 @@ void read_text_file(const char* filename, std::vector<unsigned char>& plaintext)
 	}
 }
 
-// Write the plain text file out
-void write_text_file(const char* filename, std::vector<unsigned char>& plaintext)
+// Lay out the plain text the way write_text_file always has, ready to be written
+void encode_text_file(std::vector<unsigned char>& plaintext, std::vector<unsigned char>& text_file)
 {
 	try
 	{
-		std::ofstream text_file(filename);
+		text_file.clear();
+		text_file.reserve(plaintext.size());
 		for (auto& c : plaintext)
-			text_file.put(c);
+		{
+#ifdef _WIN32
+			if (c == '\n')
+				text_file.push_back('\r');
+#endif
+			text_file.push_back(c);
+		}
 	}
 	catch (...)
 	{
-		throw std::exception("Exception in write_text_file()");
+		throw std::exception("Exception in encode_text_file()");
 		return;
 	}
 }
 
-// Read the PNG file and save the data into the data structure
-// Color values in the vector are 4 bytes per pixel, ordered RGBARGBA...
+// Where the embedded bits live inside a decoded image
+// The text is spread over a sequence of "slots", one per color channel of each pixel (alpha is skipped),
+// and each slot is the least significant byte of its channel
+struct embed_layout
+{
+	unsigned int pixel_bytes; // Bytes per pixel in the decoded image
+	unsigned int channel_bytes; // Bytes per color channel, 1 or 2 (16-bit channels are big endian)
+	unsigned int slots_per_pixel; // Color channels per pixel that carry text, excluding alpha
+};
+
+// Images are embedded in their own color type wherever possible, so an RGB carrier stays 3 bytes per
+// pixel and 16-bit carriers keep their depth
+// Palette and sub-byte greyscale images can't be, since flipping their low bits changes the color
+// entirely, so those are expanded to RGBA8 instead
+// So are images with a tRNS color key, as embedding would move pixels on or off the key color and change
+// which ones are transparent
+bool is_native_embeddable(const LodePNGColorMode& mode)
+{
+	return mode.colortype != LCT_PALETTE && mode.bitdepth >= 8 && !mode.key_defined;
+}
+
+// Whether a PNG file has a tRNS chunk, which lodepng_inspect doesn't get as far as reading
+bool has_trns_chunk(const std::vector<unsigned char>& png)
+{
+	const unsigned char* chunk = &png[8];
+	const unsigned char* end = &png[0] + png.size();
+	while (chunk + 12 <= end && !lodepng_chunk_type_equals(chunk, "IDAT"))
+	{
+		if (lodepng_chunk_type_equals(chunk, "tRNS"))
+			return true;
+		if (lodepng_chunk_length(chunk) > (size_t)(end - chunk) - 12)
+			break;
+		chunk = lodepng_chunk_next_const(chunk);
+	}
+	return false;
+}
+
+// Describe the slots of an image decoded into the given raw color mode
+embed_layout get_embed_layout(const LodePNGColorMode& raw_mode)
+{
+	embed_layout layout;
+	unsigned int channels = lodepng_get_channels(&raw_mode);
+	layout.channel_bytes = raw_mode.bitdepth / 8;
+	layout.pixel_bytes = channels * layout.channel_bytes;
+	layout.slots_per_pixel = lodepng_is_alpha_type(&raw_mode) ? channels - 1 : channels;
+	return layout;
+}
+
+// Locate a slot within the image data
+inline size_t slot_to_index(const embed_layout& layout, size_t slot)
+{
+	size_t pixel = slot / layout.slots_per_pixel;
+	size_t channel = slot % layout.slots_per_pixel;
+	return pixel * layout.pixel_bytes + (channel + 1) * layout.channel_bytes - 1;
+}
+
+// The header embedded ahead of the text
+// Embedded as the magic "tsSg", a version byte, a flags byte, the size of the whole header (2 bytes), the
+// length of the text (8 bytes), the bits per slot of the text (1 byte), the IV (16 bytes), the key
+// derivation salt (16 bytes), the key derivation iterations (4 bytes), the shard index (4 bytes), the
+// number of shards (4 bytes), then the length of the whole payload (8 bytes), with every number little
+// endian
+// Readers go by the header_size found in the image, so later versions can append fields: an older reader
+// skips the ones it doesn't know, and a newer one reads the ones an older header lacks as zero
+// Images embedded before there was a header have only the 4-byte text length, in host byte order
+struct payload_header
+{
+	unsigned int version; // 0 for the legacy size-only header
+	unsigned int flags;
+	unsigned int header_size; // Bytes, as embedded
+	unsigned long long length; // Bytes of text after the header
+	unsigned int bits_per_slot; // With PAYLOAD_FLAG_DENSITY, 1 to 4; otherwise 0, the 3-2-3 split
+	unsigned char iv[16]; // With PAYLOAD_FLAG_IV, a random one for each payload
+	unsigned char salt[KDF_SALT_BYTES]; // With PAYLOAD_FLAG_KDF, shared by the payloads of a batch (see run_batch)
+	unsigned int kdf_iterations; // With PAYLOAD_FLAG_KDF
+	unsigned int shard_index; // With PAYLOAD_FLAG_SHARD, which shard of the payload this is, from 0
+	unsigned int shard_count; // With PAYLOAD_FLAG_SHARD
+	unsigned long long payload_length; // With PAYLOAD_FLAG_SHARD, bytes in all the shards together
+
+	payload_header() : version(PAYLOAD_VERSION), flags(0), header_size(PAYLOAD_HEADER_SIZE), length(0), 
+		bits_per_slot(0), kdf_iterations(0), shard_index(0), shard_count(0), payload_length(0)
+	{
+		memset(iv, 0, sizeof(iv));
+		memset(salt, 0, sizeof(salt));
+	}
+};
+
+static void put_le(unsigned char* out, unsigned long long value, unsigned int bytes)
+{
+	for (unsigned int i = 0; i < bytes; i++)
+		out[i] = (unsigned char)(value >> (8 * i));
+}
+
+static unsigned long long get_le(const unsigned char* in, unsigned int bytes)
+{
+	unsigned long long value = 0;
+	for (unsigned int i = 0; i < bytes; i++)
+		value |= (unsigned long long)in[i] << (8 * i);
+	return value;
+}
+
+// Lay out the header as it's embedded
+std::vector<unsigned char> write_payload_header(const payload_header& header)
+{
+	std::vector<unsigned char> bytes(PAYLOAD_HEADER_SIZE, 0);
+	memcpy(&bytes[0], PAYLOAD_MAGIC, 4);
+	bytes[4] = (unsigned char)header.version;
+	bytes[5] = (unsigned char)header.flags;
+	put_le(&bytes[6], bytes.size(), 2);
+	put_le(&bytes[8], header.length, 8);
+	bytes[16] = (unsigned char)header.bits_per_slot;
+	memcpy(&bytes[17], header.iv, sizeof(header.iv));
+	memcpy(&bytes[33], header.salt, sizeof(header.salt));
+	put_le(&bytes[49], header.kdf_iterations, 4);
+	put_le(&bytes[53], header.shard_index, 4);
+	put_le(&bytes[57], header.shard_count, 4);
+	put_le(&bytes[61], header.payload_length, 8);
+	return bytes;
+}
+
+// Read the fields of a header already recovered from the image
+// bytes must hold at least PAYLOAD_HEADER_SIZE bytes, zero past the end of the embedded header
+void read_payload_header(const std::vector<unsigned char>& bytes, payload_header& header)
+{
+	header.version = bytes[4];
+	header.flags = bytes[5];
+	header.header_size = (unsigned int)get_le(&bytes[6], 2);
+	header.length = get_le(&bytes[8], 8);
+	header.bits_per_slot = bytes[16];
+	memcpy(header.iv, &bytes[17], sizeof(header.iv));
+	memcpy(header.salt, &bytes[33], sizeof(header.salt));
+	header.kdf_iterations = (unsigned int)get_le(&bytes[49], 4);
+	header.shard_index = (unsigned int)get_le(&bytes[53], 4);
+	header.shard_count = (unsigned int)get_le(&bytes[57], 4);
+	header.payload_length = get_le(&bytes[61], 8);
+}
+
+// The layout the text itself is embedded with
+// The header is always embedded in the image's own slots with the 3-2-3 split, so that it can be found
+// before we know how the text was embedded; the text can also use the alpha channel
+embed_layout get_text_layout(const embed_layout& layout, const payload_header& header)
+{
+	embed_layout text_layout = layout;
+	if (header.flags & PAYLOAD_FLAG_ALPHA)
+		text_layout.slots_per_pixel = layout.pixel_bytes / layout.channel_bytes;
+	return text_layout;
+}
+
+// The slot (in the text layout) the text starts at: the first pixel after the header's
+size_t get_text_first_slot(const embed_layout& layout, const payload_header& header)
+{
+	size_t header_slots = 3 * (size_t)header.header_size;
+	size_t header_pixels = (header_slots + layout.slots_per_pixel - 1) / layout.slots_per_pixel;
+	return header_pixels * get_text_layout(layout, header).slots_per_pixel;
+}
+
+// The number of text bytes that fit in an image of the given number of pixels after the header
+unsigned long long get_text_capacity(unsigned long long pixels, const embed_layout& layout, const payload_header& header)
+{
+	unsigned long long slots = pixels * get_text_layout(layout, header).slots_per_pixel;
+	unsigned long long first_slot = get_text_first_slot(layout, header);
+	if (slots <= first_slot)
+		return 0;
+	slots -= first_slot;
+	return header.bits_per_slot ? slots * header.bits_per_slot / 8 : slots / 3;
+}
+
+// Turn off every checksum the decoder would verify: the CRC of each chunk (IHDR included) and the Adler-32
+// of the zlib stream
+// Only for images we produced ourselves and stored somewhere that already guarantees their integrity
+void set_trusted_input(lodepng::State& state)
+{
+	state.decoder.ignore_crc = 1;
+	state.decoder.zlibsettings.ignore_adler32 = 1;
+}
+
+// Whether lodepng::decode verifies the CRC of a chunk: it only does so for the chunk types it knows
+bool is_crc_checked_chunk(const unsigned char* chunk)
+{
+	static const char* const known[] = { "IHDR", "IDAT", "IEND", "PLTE", "tRNS", "bKGD", "tEXt", "zTXt", "iTXt",
+		"tIME", "pHYs" };
+	for (auto type : known)
+		if (lodepng_chunk_type_equals(chunk, type))
+			return true;
+	return false;
+}
+
+// Decode a PNG file already in memory
+// The image is decoded in the color type of the PNG file itself (see is_native_embeddable), which is left
+// in state.info_raw along with everything else about the file so it can be written back the same way
+// Images written with --segments are decoded in parallel (see parallel_png.cpp)
+// Returns the number of checksums that went unverified because of set_trusted_input, 0 normally
 // On an error, throws an exception
-void read_png_from_file(const char* filename, std::vector<unsigned char>& image, unsigned int& width, unsigned int& height)
+unsigned int decode_png(const std::vector<unsigned char>& png, std::vector<unsigned char>& image, 
+	unsigned int& width, unsigned int& height, lodepng::State& state)
 {
 	unsigned int error = 0;
+	unsigned int skipped_checks = 0;
+	bool decoded = false;
 	try
 	{
-		unsigned int error = lodepng::decode(image, width, height, filename);
+		if (png.empty())
+			error = 78; // Same as lodepng's "failed to open file for reading"
+		if (!error)
+			error = lodepng_inspect(&width, &height, &state, &png[0], png.size());
+		if (!error)
+		{
+			if (is_native_embeddable(state.info_png.color) && !has_trns_chunk(png))
+			{
+				lodepng_color_mode_copy(&state.info_raw, &state.info_png.color);
+				error = decode_segmented_png(image, width, height, state, png, decoded);
+			}
+			else
+				lodepng_color_mode_init(&state.info_raw); // Default raw mode is RGBA8
+			if (!error && !decoded)
+				error = lodepng::decode(image, width, height, state, png);
+		}
+
+		// Only the chunks that would have been verified otherwise: the segmented decoder checks all of them
+		if (!error && state.decoder.ignore_crc)
+		{
+			const unsigned char* chunk = &png[8];
+			const unsigned char* end = &png[0] + png.size();
+			while (chunk + 12 <= end)
+			{
+				if (decoded || is_crc_checked_chunk(chunk))
+					skipped_checks++;
+				if (lodepng_chunk_type_equals(chunk, "IEND"))
+					break;
+				chunk = lodepng_chunk_next_const(chunk);
+			}
+		}
+		if (!error && state.decoder.zlibsettings.ignore_adler32)
+			skipped_checks++;
 	}
 	catch (...)
 	{
 		throw std::exception("Exception in lodepng::decode()");
-		return;
 	}
 
 	if (error)
@@ -96,22 +443,70 @@ void read_png_from_file(const char* filename, std::vector<unsigned char>& image,
 		std::string s = err_desc.str();
 		throw std::exception(s.c_str());
 	}
+
+	return skipped_checks;
+}
+
+// Read only the signature and IHDR chunk of a PNG file, without decoding any image data
+// Used to reject carriers that can't hold the payload before paying for encryption and a full decode
+// The color type is left in state.info_png.color
+// On an error, throws an exception
+void inspect_png(const std::vector<unsigned char>& png, unsigned int& width, unsigned int& height, lodepng::State& state)
+{
+	// 8 byte signature, then the IHDR chunk: 4 byte length, 4 byte type, 13 bytes of data, 4 byte CRC
+	if (png.size() < 33)
+		throw std::exception("Exception in inspect_png: unable to read the PNG header");
+
+	unsigned int error = lodepng_inspect(&width, &height, &state, &png[0], 33);
+
+	if (error)
+	{
+		std::stringstream err_desc;
+		err_desc << "Decoder error " << error << ": " << lodepng_error_text(error);
+		std::string s = err_desc.str();
+		throw std::exception(s.c_str());
+	}
+}
+
+// The number of text bytes an image of the given dimensions and PNG color type can hold, at the
+// density set in the header (see get_text_capacity)
+unsigned long long carrier_capacity_bytes(unsigned int width, unsigned int height, const LodePNGColorMode& png_mode,
+	const payload_header& header)
+{
+	LodePNGColorMode rgba;
+	lodepng_color_mode_init(&rgba);
+	embed_layout layout = get_embed_layout(is_native_embeddable(png_mode) ? png_mode : rgba);
+
+	return get_text_capacity((unsigned long long)width * height, layout, header);
 }
 
-// Write the PNG file from the data structure
-// Color values in the vector are 4 bytes per pixel, ordered RGBARGBA...
+// Encode the PNG file from the data structure
+// The image is encoded in the same color type it was decoded in (state.info_raw), so no conversion or 
+// color profiling happens unless the carrier had to be expanded to RGBA8
+// With more than one segment, native carriers are written so they can be decoded in parallel (see
+// parallel_png.cpp)
 // On an error, throws an exception
-void write_png_to_file(const char* filename, std::vector<unsigned char>& image, unsigned int width, unsigned int height)
+void encode_png(std::vector<unsigned char>& png, std::vector<unsigned char>& image, unsigned int width, unsigned int height,
+	lodepng::State& state, unsigned int segments = 1)
 {
 	unsigned int error = 0;
 
 	try
 	{
-		unsigned error = lodepng::encode(filename, image, width, height);
+		// Let lodepng pick a color type only for expanded carriers, which might fit back into a palette
+		state.encoder.auto_convert = is_native_embeddable(state.info_png.color) ? 0 : 1;
+		lodepng_color_mode_copy(&state.info_png.color, &state.info_raw);
+		state.info_png.interlace_method = 0;
+
+		png.clear();
+		if (segments > 1 && !state.encoder.auto_convert)
+			error = encode_segmented_png(png, &image[0], width, height, state, segments);
+		else
+			error = lodepng::encode(png, image, width, height, state);
 	}
 	catch (...)
 	{
-		throw std::exception("Exception in lodepng::decode()");
+		throw std::exception("Exception in lodepng::encode()");
 		return;
 	}
 
@@ -124,188 +519,465 @@ void write_png_to_file(const char* filename, std::vector<unsigned char>& image,
 	}
 }
 
-// Take the 8 bits per char and split them 3-2-3, putting 3 bits into the Red, 2 bits into the Green,
-// 3 bits into the Blue, and nothing in Alpha
-// The bits will be placed starting from the LSB of each byte so as to make the least impact to the 
-// image when viewed by a human
-// We put fewer bits into the Green channel because human eyes are more sensitive to a yellowish-green
-// The using_XOR flag allows the merge to either overwrite the destination bits in the img data, or XOR
-// the source bits (from the text data) with the destination
-// Throws std::exception on error
-void merge_text_into_img_data(std::vector<unsigned char>& text_data, std::vector<unsigned char>& img_data, bool using_XOR=false)
+// Set the zlib and filter settings for one of the named compression presets (not auto, see below)
+// Throws std::exception for an unknown preset name
+void apply_compression_preset(const std::string& level, lodepng::State& state)
 {
-	try
-	{
-		// Bounds check
-		// Using 4 * the plaintext size because each element in img_data is a color channel of a pixel, of which
-		// there are 4 channels per pixel, and we're going to overwrite certain bits across three of the channels
-		if (img_data.size() < 4 * text_data.size())
-			throw std::exception("Exception in merge_text_into_img_data: image is too small to fit all the text");
+	LodePNGEncoderSettings& encoder = state.encoder;
+	LodePNGCompressSettings& zlib = encoder.zlibsettings;
 
+	if (level == COMPRESSION_LEVEL_STORE)
+	{
+		// Stored deflate blocks and no filtering: about as fast as writing the raw pixels
+		zlib.btype = 0;
+		zlib.use_lz77 = 0;
+		encoder.filter_strategy = LFS_ZERO;
 	}
-	catch (...)
+	else if (level == COMPRESSION_LEVEL_FAST)
 	{
-		throw std::exception("Exception in merge_text_into_img_data: possible invalid reference to image or text data");
+		// A small window and short hash chains with no lazy matching, and no per-row filter search
+		zlib.btype = 2;
+		zlib.use_lz77 = 1;
+		zlib.windowsize = 256;
+		zlib.minmatch = 3;
+		zlib.nicematch = 32;
+		zlib.lazymatching = 0;
+		zlib.maxchainlength = 8;
+		encoder.filter_strategy = LFS_ZERO;
+	}
+	else if (level == COMPRESSION_LEVEL_DEFAULT)
+	{
+		// lodepng's own defaults
+		lodepng_compress_settings_init(&zlib);
+		encoder.filter_strategy = LFS_MINSUM;
+	}
+	else if (level == COMPRESSION_LEVEL_MAX)
+	{
+		// The full deflate window, and the filter giving the lowest entropy per row
+		zlib.btype = 2;
+		zlib.use_lz77 = 1;
+		zlib.windowsize = 32768;
+		zlib.minmatch = 3;
+		zlib.nicematch = 258;
+		zlib.lazymatching = 1;
+		zlib.maxchainlength = 0; // Walk the whole window
+		encoder.filter_strategy = LFS_ENTROPY;
+	}
+	else
+	{
+		std::string err = "Exception in apply_compression_preset: unknown compression level " + level;
+		throw std::exception(err.c_str());
 	}
+}
+
+// Check a --level argument: one of the presets, "auto", or "auto:N" with N a number of milliseconds
+// above 0, which is returned in budget_ms (and the default for plain "auto")
+// Returns false if it's none of those
+bool parse_compression_level(const std::string& level, double& budget_ms)
+{
+	budget_ms = COMPRESSION_AUTO_DEFAULT_BUDGET_MS;
+	if (level.compare(0, strlen(COMPRESSION_LEVEL_AUTO), COMPRESSION_LEVEL_AUTO) != 0)
+		return level == COMPRESSION_LEVEL_STORE || level == COMPRESSION_LEVEL_FAST ||
+			level == COMPRESSION_LEVEL_DEFAULT || level == COMPRESSION_LEVEL_MAX;
+	if (level.size() == strlen(COMPRESSION_LEVEL_AUTO))
+		return true;
+	if (level[strlen(COMPRESSION_LEVEL_AUTO)] != ':')
+		return false;
 
-	// The first 4 bytes of the encoded data become the size of that data
-	// so we perform that insertion here
-	unsigned int text_size_bytes = text_data.size();
-	unsigned char text_size_bytes_uc[4] = { 0 };
-	memcpy(text_size_bytes_uc, &text_size_bytes, 4);
-	text_data.insert(text_data.begin(), text_size_bytes_uc, text_size_bytes_uc+4);
+	const char* budget = level.c_str() + strlen(COMPRESSION_LEVEL_AUTO) + 1;
+	char* end = NULL;
+	budget_ms = strtod(budget, &end);
+	return end != budget && !*end && budget_ms > 0;
+}
+
+// Set the compression settings for a --level argument
+// "auto" or "auto:N" picks the strongest preset expected to encode within N milliseconds per megapixel
+// (250 by default), by timing each preset on a strip of rows from the middle of the image and scaling 
+// that up to a megapixel
+// Throws std::exception for an unknown level
+void apply_compression_level(const std::string& level, lodepng::State& state, 
+	std::vector<unsigned char>& image, unsigned int width, unsigned int height)
+{
+	double budget_ms;
+	if (!parse_compression_level(level, budget_ms))
+	{
+		std::string err = "Exception in apply_compression_level: unknown compression level " + level;
+		throw std::exception(err.c_str());
+	}
+	if (level.compare(0, strlen(COMPRESSION_LEVEL_AUTO), COMPRESSION_LEVEL_AUTO) != 0)
+	{
+		apply_compression_preset(level, state);
+		return;
+	}
 
-	unsigned char tmp = 0;
-	unsigned int img_index = 0;
+	const unsigned int sample_rows = height < 32 ? height : 32;
+	const unsigned int first_row = (height - sample_rows) / 2;
+	const size_t row_bytes = image.size() / height;
+	const double sample_megapixels = (double)width * sample_rows / 1000000.0;
 
-	// Loop through all the characters
-	for (auto& c : text_data)
+	// Strongest first, the first one to fit the budget wins
+	static const char* candidates[] = { COMPRESSION_LEVEL_MAX, COMPRESSION_LEVEL_DEFAULT, COMPRESSION_LEVEL_FAST };
+	for (auto candidate : candidates)
 	{
-		// First color channel is Red
+		lodepng::State trial = state;
+		apply_compression_preset(candidate, trial);
+		trial.encoder.auto_convert = 0;
+		lodepng_color_mode_copy(&trial.info_png.color, &trial.info_raw);
 
-		// First 3 MSBs from the character are put into the Red channel's 3 LSBs
-		tmp = c >> 5; // shift those 3 bits to the right 5 to make them align with the 3 LSBs
+		std::vector<unsigned char> png;
+		auto start = std::chrono::steady_clock::now();
+		lodepng::encode(png, &image[first_row * row_bytes], width, sample_rows, trial);
+		double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 
-		// Depending on the XOR state flag, either overwrite the data or XOR the text into it
-		if (!using_XOR)
+		if (elapsed_ms / sample_megapixels <= budget_ms)
 		{
-			// merge the 5 bits from the original with the 3 shifted MSBs of the text
-			img_data[img_index] = (img_data[img_index] & 0xF8) | (tmp & 0x7);
+			apply_compression_preset(candidate, state);
+			return;
 		}
-		else // Otherwise XOR the bits in, requiring the original image's pixel data to extract
+	}
+
+	apply_compression_preset(COMPRESSION_LEVEL_STORE, state);
+}
+
+// The 3-2-3 split: bits per slot, and where they sit in the character
+static const unsigned char slot_shift[3] = { 5, 3, 0 };
+static const unsigned char slot_mask[3] = { 0x7, 0x3, 0x7 };
+
+// Embed count bytes into the image, three slots each, starting at first_slot
+// The caller has already checked that the slots exist
+static void embed_bytes(const unsigned char* bytes, size_t count, std::vector<unsigned char>& img_data,
+	const embed_layout& layout, size_t first_slot, bool using_XOR)
+{
+	size_t slot = first_slot;
+	for (size_t n = 0; n < count; n++)
+	{
+		unsigned char c = bytes[n];
+		for (unsigned int i = 0; i < 3; i++, slot++)
 		{
-			img_data[img_index] ^= (tmp & 0x7);
+			unsigned char& channel = img_data[slot_to_index(layout, slot)];
+			unsigned char tmp = (c >> slot_shift[i]) & slot_mask[i];
+
+			// Depending on the XOR state flag, either overwrite the data or XOR the text into it
+			if (!using_XOR)
+				channel = (channel & ~slot_mask[i]) | tmp;
+			else // Otherwise XOR the bits in, requiring the original image's pixel data to extract
+				channel ^= tmp;
 		}
+	}
+}
 
-		img_index++; // Next color channel (Green)
+// The reverse of embed_bytes: recover count bytes starting at first_slot into bytes
+// ref_img_data is only read when using_XOR is set
+static void recover_bytes(unsigned char* bytes, size_t count, const std::vector<unsigned char>& img_data,
+	const std::vector<unsigned char>& ref_img_data, const embed_layout& layout, size_t first_slot, bool using_XOR)
+{
+	size_t slot = first_slot;
+	for (size_t n = 0; n < count; n++)
+	{
+		unsigned char reconstruct = 0;
+		for (unsigned int i = 0; i < 3; i++, slot++)
+		{
+			size_t index = slot_to_index(layout, slot);
+			unsigned char tmp = using_XOR ? img_data[index] ^ ref_img_data[index] : img_data[index];
+			reconstruct |= (tmp & slot_mask[i]) << slot_shift[i];
+		}
+		bytes[n] = reconstruct;
+	}
+}
 
-		// Next 2 bits from the character are put into the Green channel's 2 LSBs
-		tmp = c << 3; // shave off the 3 MSBs
-		tmp = tmp >> 6; // shift back 6 to make them align with the 2 LSBs
-		// Depending on the XOR state flag, either overwrite the data or XOR the text into it
-		if (!using_XOR)
+// Embed count bytes into the image at BITS bits per slot, starting at first_slot
+// The bits of the text go in as one stream, most significant first, so with 3 bits a byte can straddle
+// slots; the last slot is padded with zeros
+// Each density gets its own copy of the loop, with the shifts and masks known at compile time
+template <unsigned int BITS>
+static void embed_bits(const unsigned char* bytes, size_t count, std::vector<unsigned char>& img_data,
+	const embed_layout& layout, size_t first_slot, bool using_XOR)
+{
+	const unsigned char mask = (1 << BITS) - 1;
+	size_t slot = first_slot;
+	unsigned int buffer = 0; // Bits not embedded yet, in the low bits_buffered bits
+	unsigned int bits_buffered = 0;
+	for (size_t n = 0; n < count || bits_buffered > 0; )
+	{
+		if (bits_buffered < BITS)
 		{
-			// merge the 5 bits from the original with the 2 shifted MSBs of the text
-			img_data[img_index] = (img_data[img_index] & 0xFC) | (tmp & 0x3);
+			if (n < count)
+			{
+				buffer = (buffer << 8) | bytes[n++];
+				bits_buffered += 8;
+			}
+			else
+			{
+				buffer <<= BITS - bits_buffered;
+				bits_buffered = BITS;
+			}
+			continue;
 		}
-		else // Otherwise XOR the bits in, requiring the original image's pixel data to extract
-			img_data[img_index] ^= (tmp & 0x7);
 
-		img_index++; // Next color channel (Blue)
+		bits_buffered -= BITS;
+		unsigned char tmp = (buffer >> bits_buffered) & mask;
+		buffer &= (1u << bits_buffered) - 1;
 
-		// The 3 LSBs from the character are put into the Blue channel's 3 LSBs
-		tmp = c;
-		// Depending on the XOR state flag, either overwrite the data or XOR the text into it
+		unsigned char& channel = img_data[slot_to_index(layout, slot++)];
 		if (!using_XOR)
+			channel = (channel & ~mask) | tmp;
+		else
+			channel ^= tmp;
+	}
+}
+
+// The reverse of embed_bits, starting offset bytes into the text, which needn't be on a slot boundary
+template <unsigned int BITS>
+static void recover_bits(unsigned char* bytes, size_t count, const std::vector<unsigned char>& img_data,
+	const std::vector<unsigned char>& ref_img_data, const embed_layout& layout, size_t first_slot, size_t offset,
+	bool using_XOR)
+{
+	const unsigned char mask = (1 << BITS) - 1;
+	size_t slot = first_slot + offset * 8 / BITS;
+	unsigned int skip = offset * 8 % BITS; // Bits of the first slot that belong to the byte before
+	unsigned int buffer = 0;
+	unsigned int bits_buffered = 0;
+	if (skip && count > 0)
+	{
+		size_t index = slot_to_index(layout, slot++);
+		unsigned char tmp = using_XOR ? img_data[index] ^ ref_img_data[index] : img_data[index];
+		buffer = tmp & (mask >> skip);
+		bits_buffered = BITS - skip;
+	}
+	for (size_t n = 0; n < count; )
+	{
+		if (bits_buffered >= 8)
 		{
-			// merge the 5 bits from the original with the 3 shifted MSBs of the text
-			img_data[img_index] = (img_data[img_index] & 0xF8) | (tmp & 0x7);
+			bits_buffered -= 8;
+			bytes[n++] = (unsigned char)(buffer >> bits_buffered);
+			buffer &= (1u << bits_buffered) - 1;
+			continue;
 		}
-		else // Otherwise XOR the bits in, requiring the original image's pixel data to extract
-			img_data[img_index] ^= (tmp & 0x7);
-		
-		img_index++; // Next color channel (Alpha)
-		img_index++; // Next color channel (Red of the next pixel...so we're ready for next char)
+
+		size_t index = slot_to_index(layout, slot++);
+		unsigned char tmp = using_XOR ? img_data[index] ^ ref_img_data[index] : img_data[index];
+		buffer = (buffer << BITS) | (tmp & mask);
+		bits_buffered += BITS;
 	}
 }
 
-// PARAMETERS: Image Data, Reference Image Data, Text Data, Using_XOR
-// Given an image or images, extract the text found inside them
-// See the merge function for more on how the text is embedded in the image
-// If the using_XOR flag is set, ref_img_data must be valid, as it's required
-// in order to extract the text properly
-// ref_img_data can be NULL, but using_XOR must be false if it is
-// text_data should be an empty vector, but if it isn't, the data will be appended to the end
+// Embed the text at the density recorded in its header
+static void embed_text(const payload_header& header, const unsigned char* bytes, size_t count, 
+	std::vector<unsigned char>& img_data, const embed_layout& text_layout, size_t first_slot, bool using_XOR)
+{
+	switch (header.bits_per_slot)
+	{
+	case 1: embed_bits<1>(bytes, count, img_data, text_layout, first_slot, using_XOR); break;
+	case 2: embed_bits<2>(bytes, count, img_data, text_layout, first_slot, using_XOR); break;
+	case 3: embed_bits<3>(bytes, count, img_data, text_layout, first_slot, using_XOR); break;
+	case 4: embed_bits<4>(bytes, count, img_data, text_layout, first_slot, using_XOR); break;
+	default: embed_bytes(bytes, count, img_data, text_layout, first_slot, using_XOR); break;
+	}
+}
+
+// Recover count bytes of the text, starting offset bytes in, at the density recorded in its header
+static void recover_text(const payload_header& header, unsigned char* bytes, size_t count,
+	const std::vector<unsigned char>& img_data, const std::vector<unsigned char>& ref_img_data,
+	const embed_layout& text_layout, size_t first_slot, size_t offset, bool using_XOR)
+{
+	switch (header.bits_per_slot)
+	{
+	case 1: recover_bits<1>(bytes, count, img_data, ref_img_data, text_layout, first_slot, offset, using_XOR); break;
+	case 2: recover_bits<2>(bytes, count, img_data, ref_img_data, text_layout, first_slot, offset, using_XOR); break;
+	case 3: recover_bits<3>(bytes, count, img_data, ref_img_data, text_layout, first_slot, offset, using_XOR); break;
+	case 4: recover_bits<4>(bytes, count, img_data, ref_img_data, text_layout, first_slot, offset, using_XOR); break;
+	default: recover_bytes(bytes, count, img_data, ref_img_data, text_layout, first_slot + 3 * offset, using_XOR); break;
+	}
+}
+
+// Take the 8 bits per char and split them 3-2-3 across three consecutive slots (see embed_layout),
+// which for an RGB or RGBA image means 3 bits into the Red, 2 bits into the Green, 3 bits into the Blue, 
+// and nothing in Alpha
+// The bits will be placed starting from the LSB of each byte so as to make the least impact to the 
+// image when viewed by a human
+// We put fewer bits into the Green channel because human eyes are more sensitive to a yellowish-green
+// The using_XOR flag allows the merge to either overwrite the destination bits in the img data, or XOR
+// the source bits (from the text data) with the destination
+// That's how the header is always embedded, but the text itself can be packed denser, at 1 to 4 bits of
+// every slot and into alpha as well, as set in the header (see get_text_layout)
+// The text is only read: the header is embedded from its own small buffer, then the text after it
+// The header's length is filled in from text_size
 // Throws std::exception on error
-void extract_text_from_img_data(std::vector<unsigned char>& img_data, 
-								std::vector<unsigned char>& ref_img_data, 
-								std::vector<unsigned char>& text_data, 
-								bool using_XOR = false)
+void merge_text_into_img_data(const payload_header& header, const unsigned char* text_data, size_t text_size,
+	std::vector<unsigned char>& img_data, const embed_layout& layout, bool using_XOR=false)
 {
+	payload_header text_header = header;
+	text_header.length = text_size;
+	if (layout.slots_per_pixel == layout.pixel_bytes / layout.channel_bytes)
+		text_header.flags &= ~PAYLOAD_FLAG_ALPHA; // No alpha channel to use
+	std::vector<unsigned char> header_bytes = write_payload_header(text_header);
+	embed_layout text_layout = get_text_layout(layout, text_header);
+
 	try
 	{
-		// Validate inputs
-		// Just trying to trigger an exception here if these are NULL pointers
-		unsigned int img_data_size = img_data.size();
-		unsigned int text_data_size = text_data.size();
-		unsigned int ref_img_data_size = ref_img_data.size();
-		if (using_XOR)
-			ref_img_data_size = ref_img_data.size();				
+		// Bounds check
+		// Each character of the header takes 3 slots, and the text follows at its own density
+		size_t pixels = img_data.size() / layout.pixel_bytes;
+		if (pixels * layout.slots_per_pixel < 3 * header_bytes.size() || 
+			text_size > get_text_capacity(pixels, layout, text_header))
+			throw std::exception("Exception in merge_text_into_img_data: image is too small to fit all the text");
+
 	}
 	catch (...)
 	{
-		throw std::exception("Exception in extract_text_from_img_data: possible invalid reference to image or text data");
+		throw std::exception("Exception in merge_text_into_img_data: possible invalid reference to image or text data");
 	}
 
-	unsigned char tmp = 0;
-	unsigned char reconstruct = 0;
-	unsigned int index = 0;
-	unsigned int size_in_bytes = 0;
-	bool finished = false;
+	embed_bytes(&header_bytes[0], header_bytes.size(), img_data, layout, 0, using_XOR);
+	embed_text(text_header, text_data, text_size, img_data, text_layout, get_text_first_slot(layout, text_header), using_XOR);
+}
+
+// PARAMETERS: Image Data, Reference Image Data, Layout, Using_XOR, Header
+// Given an image or images, find the header of the text embedded in them, and check the text fits after it
+// The text itself is then read with recover_text_from_img_data, all of it or just the part that's needed
+// See the merge function for more on how the text is embedded in the image
+// If the using_XOR flag is set, ref_img_data must be valid, as it's required
+// in order to extract the text properly, and must have the same layout as img_data
+// ref_img_data can be empty, but using_XOR must be false if it is
+// Leaves a header with a length of 0 if the image is too small to hold even the legacy header
+// Throws std::exception on error
+void find_text_in_img_data(const std::vector<unsigned char>& img_data,
+							const std::vector<unsigned char>& ref_img_data,
+							const embed_layout& layout,
+							bool using_XOR,
+							payload_header& header)
+{
+	if (using_XOR && ref_img_data.size() < img_data.size())
+		throw std::exception("Exception in find_text_in_img_data: reference image is too small.");
+
+	header = payload_header();
+	size_t capacity = img_data.size() / layout.pixel_bytes * layout.slots_per_pixel / 3;
+	if (capacity < LEGACY_HEADER_SIZE)
+		return;
 
-	// Loop through all the color channels of all the pixels
-	for (auto& p : img_data)
+	// Read the fixed start of the header first, then the rest of it once we know how big it is
+	std::vector<unsigned char> header_bytes(PAYLOAD_HEADER_SIZE, 0); // Zero for fields older headers lack
+	recover_bytes(&header_bytes[0], LEGACY_HEADER_SIZE, img_data, ref_img_data, layout, 0, using_XOR);
+	if (memcmp(&header_bytes[0], PAYLOAD_MAGIC, 4) != 0)
 	{
-		// Once we have the first 4 bytes, then we can determine the actual size of the output
-		// text file
-		if (text_data.size() == 4 && !size_in_bytes)
-		{
-			unsigned char sz[4] = { 0 };
-			std::vector<unsigned char>::iterator it = text_data.begin();
-			for (unsigned int j = 0; j < 4; j++)
-			{
-				sz[j] = *it;
-				it++;
-			}
-			memcpy(&size_in_bytes, sz, 4);
-			text_data.clear();
-		}
+		unsigned int legacy_size = 0;
+		memcpy(&legacy_size, &header_bytes[0], LEGACY_HEADER_SIZE);
+		header.version = 0;
+		header.header_size = LEGACY_HEADER_SIZE;
+		header.length = legacy_size;
+	}
+	else
+	{
+		if (capacity < 8)
+			throw std::exception("Exception in find_text_in_img_data: image is too small for the embedded header.");
+		recover_bytes(&header_bytes[4], 4, img_data, ref_img_data, layout, 3 * 4, using_XOR);
+		size_t header_size = (size_t)get_le(&header_bytes[6], 2);
+		if (header_size < PAYLOAD_MIN_HEADER_SIZE || header_size > capacity)
+			throw std::exception("Exception in find_text_in_img_data: the embedded header is damaged or too large for the image.");
+		if (header_bytes.size() < header_size)
+			header_bytes.resize(header_size, 0);
+		recover_bytes(&header_bytes[8], header_size - 8, img_data, ref_img_data, layout, 3 * 8, using_XOR);
+		read_payload_header(header_bytes, header);
+		if (header.flags & ~PAYLOAD_KNOWN_FLAGS || header.bits_per_slot > MAX_BITS_PER_SLOT ||
+			(header.bits_per_slot == 0) != !(header.flags & PAYLOAD_FLAG_DENSITY))
+			throw std::exception("Exception in find_text_in_img_data: the text was embedded with options this version doesn't support.");
+		if ((header.flags & PAYLOAD_FLAG_KDF) && (header.kdf_iterations == 0 || header.kdf_iterations > KDF_MAX_ITERATIONS))
+			throw std::exception("Exception in find_text_in_img_data: the embedded header is damaged.");
+		if ((header.flags & PAYLOAD_FLAG_SHARD) && 
+			(header.shard_index >= header.shard_count || header.length > header.payload_length))
+			throw std::exception("Exception in find_text_in_img_data: the embedded header is damaged.");
+	}
 
-		// If we know our size, and we're using XOR, and our ref img doesn't have enough bytes,
-		// abort
-		if (size_in_bytes && size_in_bytes > ref_img_data.size())
-			throw std::exception("Exception in extract_text_from_img_data: reference image is too small.");
+	if (header.length > get_text_capacity(img_data.size() / layout.pixel_bytes, layout, header))
+		throw std::exception("Exception in find_text_in_img_data: image is too small for the embedded size.");
+}
 
-		// If we know our size, and we've reached our size, we're done
-		if (size_in_bytes && size_in_bytes == text_data.size())
-			break;
+// Recover count bytes of the text found by find_text_in_img_data, starting offset bytes in
+// Only the slots holding those bytes are read
+void recover_text_from_img_data(const std::vector<unsigned char>& img_data,
+								const std::vector<unsigned char>& ref_img_data,
+								const embed_layout& layout,
+								bool using_XOR,
+								const payload_header& header,
+								size_t offset,
+								size_t count,
+								unsigned char* bytes)
+{
+	if (offset > header.length || count > header.length - offset)
+		throw std::exception("Exception in recover_text_from_img_data: reading past the end of the text.");
+	if (count > 0)
+		recover_text(header, bytes, count, img_data, ref_img_data, get_text_layout(layout, header),
+			get_text_first_slot(layout, header), offset, using_XOR);
+}
 
-		if (using_XOR)
-			tmp = p ^ ref_img_data[index];
-		else
-			tmp = p;
+// Parse a --mem-budget or --chunk-size value: a number of bytes, optionally followed by K, M or G
+// Returns 0 if it isn't valid
+unsigned long long parse_memory_size(const std::string& value)
+{
+	char* end = 0;
+	unsigned long long size = strtoull(value.c_str(), &end, 10);
+	if (end == value.c_str())
+		return 0;
+	switch (toupper(*end))
+	{
+	case 'G': size <<= 10; // Fall through
+	case 'M': size <<= 10; // Fall through
+	case 'K': size <<= 10; end++; break;
+	}
+	return *end ? 0 : size;
+}
 
-		// To reconstruct the character, we need 3 bits of Red, 2 bits of Green, and 3 bits of Blue
-		switch (index % 4)
-		{
-		case 0:
-			tmp = tmp << 5; // Red Channel = shift left 5 bits
-			reconstruct |= tmp;
-			break;
-		case 1: 
-			tmp = tmp << 6; // Green Channel = shift left 6 bits...
-			tmp = tmp >> 3; // ...then back right 3 bits
-			reconstruct |= tmp;
-			break;
-		case 2:
-			tmp = tmp << 5; // Blue Channel = shift left 5 bits...
-			tmp = tmp >> 5; // ...then back right 5 bits
-			reconstruct |= tmp;
-			break;
-		default: // Alpha channel, so commit the reconstructed character
-			text_data.push_back(reconstruct);
-			reconstruct = 0;
-			break;
-		}
-		
-		index++;
+// Parse a --range value, first:last, as the bytes of the text from first up to (not including) last
+// last can be left out to mean the end of the text
+// Returns false if it isn't valid
+bool parse_text_range(const std::string& value, unsigned long long& first, unsigned long long& last)
+{
+	char* end = 0;
+	first = strtoull(value.c_str(), &end, 10);
+	if (end == value.c_str() || *end != ':')
+		return false;
+	const char* last_str = end + 1;
+	if (!*last_str)
+	{
+		last = ULLONG_MAX;
+		return true;
+	}
+	last = strtoull(last_str, &end, 10);
+	return end != last_str && !*end && first <= last;
+}
+
+// Stdin is read once, in full (see async_io.cpp), so only one of the files an operation reads can be -
+// Throws a std::exception, after saying so, if more than one is
+void check_stdin_inputs(std::map<unsigned int, std::string>& args_map)
+{
+	std::vector<std::string> inputs;
+	std::string& op = args_map[MAP_OPERATION_TYPE];
+	if (op == MAP_SHARD_OPERATION_NAME)
+		list_png_files(args_map[MAP_REF_IMAGE_FILENAME], inputs);
+	else if (op == MAP_UNSHARD_OPERATION_NAME)
+		list_png_files(args_map[MAP_CIPHER_IMAGE_FILENAME], inputs);
+	if (op == MAP_ENCODE_OPERATION_NAME || op == MAP_SHARD_OPERATION_NAME)
+		inputs.push_back(args_map[MAP_PLAINTEXT_FILENAME]);
+	if (op == MAP_ENCODE_OPERATION_NAME || (op == MAP_DECODE_OPERATION_NAME && args_map[MAP_USING_XOR] == MAP_USING_XOR_STR))
+		inputs.push_back(args_map[MAP_REF_IMAGE_FILENAME]);
+	if (op == MAP_DECODE_OPERATION_NAME)
+		inputs.push_back(args_map[MAP_CIPHER_IMAGE_FILENAME]);
+
+	unsigned int from_stdin = 0;
+	for (auto& input : inputs)
+		if (input == STDIO_FILENAME)
+			from_stdin++;
+	if (from_stdin > 1)
+	{
+		std::cout << "Only one input file can be - (stdin). See usage info." << std::endl;
+		throw std::exception("In capture_args: stdin given for more than one input.");
 	}
 }
 
 // Interpret and store arguments
 // Throws a std::exception on an error, or may throw an exception if no further processing is needed
 void capture_args(int argc, char** argv, 
-				std::map<unsigned char, 
+				std::map<unsigned int, 
 				std::string>& args_map)
 {
 	/******************************************************
@@ -319,36 +991,173 @@ void capture_args(int argc, char** argv,
 				This decodes the cipher image, producing a text file 
 		4. .exe decode using_xor cipher_img ref_img text optional_password_string
 				This decodes the cipher image using XOR and the reference image, producing the text
+		5. .exe batch job_file
+				This runs each line of the job file as one of the above (see run_batch)
+		6. .exe shard text carriers cipher_prefix optional_password_string
+				This spreads the text file across several reference images (see run_shard)
+		7. .exe unshard cipher_imgs text optional_password_string
+				This puts the text file back together from the images written by shard
 
 	Thus there could be 4 to 6 parameters in total, and the order varies depending on the op.
 	If there are no parameters provided or just one, the user might be requesting help.
+
+	Options (e.g. --level fast) can appear anywhere. They're taken out of the list first so
+	that the positional parameters above keep their usual order.
 	********************************************************/ 
 	int n = 0;
 
-	// If invoked with no parameters...
-	if (argc < 2)
-	{
-		display_usage_info();
-		throw std::exception("In capture_args: help requested. No further processing required.");
-	}
-
-	// Or if the second parameter is asking for help...
-	if (argv[n + 1] == "help" || argv[n + 1] == "?" ||
-		argv[n + 1] == "/help" || argv[n + 1] == "/?")
-	{
-		display_usage_info();
-		throw std::exception("In capture_args: help requested. No further processing required.");
-	}
-
-	if (argc < 4)
+	std::vector<char*> positional_args;
+	for (int i = 0; i < argc; i++)
 	{
-		std::cout << "Too few arguments provided. See usage info." << std::endl;
-		std::cout << std::endl;
-		display_usage_info();
-		throw std::exception("In capture_args: too few arguments provided.");
-	}
-
-	try
+		if (!strcmp(argv[i], MAP_COMPRESSION_LEVEL_OPT))
+		{
+			double budget_ms;
+			if (i + 1 >= argc || !parse_compression_level(argv[i + 1], budget_ms))
+			{
+				std::cout << "Missing or invalid value for " << argv[i] << ". See usage info." << std::endl;
+				throw std::exception("In capture_args: option without a value.");
+			}
+			args_map[MAP_COMPRESSION_LEVEL] = argv[++i];
+		}
+		else if (!strcmp(argv[i], MAP_SEGMENTS_OPT))
+		{
+			if (i + 1 >= argc || atoi(argv[i + 1]) < 1)
+			{
+				std::cout << "Missing or invalid value for " << argv[i] << ". See usage info." << std::endl;
+				throw std::exception("In capture_args: option without a value.");
+			}
+			args_map[MAP_SEGMENTS] = argv[++i];
+		}
+		else if (!strcmp(argv[i], MAP_STAGE_THREADS_OPT))
+		{
+			if (i + 1 >= argc)
+			{
+				std::cout << "Missing value for " << argv[i] << ". See usage info." << std::endl;
+				throw std::exception("In capture_args: option without a value.");
+			}
+			args_map[MAP_STAGE_THREADS] = argv[++i];
+		}
+		else if (!strcmp(argv[i], MAP_MEM_BUDGET_OPT))
+		{
+			if (i + 1 >= argc)
+			{
+				std::cout << "Missing value for " << argv[i] << ". See usage info." << std::endl;
+				throw std::exception("In capture_args: option without a value.");
+			}
+			args_map[MAP_MEM_BUDGET] = argv[++i];
+		}
+		else if (!strcmp(argv[i], MAP_DENSITY_OPT))
+		{
+			if (i + 1 >= argc || atoi(argv[i + 1]) < 1 || atoi(argv[i + 1]) > MAX_BITS_PER_SLOT)
+			{
+				std::cout << "Missing or invalid value for " << argv[i] << ". See usage info." << std::endl;
+				throw std::exception("In capture_args: option without a value.");
+			}
+			args_map[MAP_DENSITY] = argv[++i];
+		}
+		else if (!strcmp(argv[i], MAP_CHUNK_SIZE_OPT))
+		{
+			if (i + 1 >= argc || parse_memory_size(argv[i + 1]) == 0 || parse_memory_size(argv[i + 1]) > 0xFFFFFFFFu)
+			{
+				std::cout << "Missing or invalid value for " << argv[i] << ". See usage info." << std::endl;
+				throw std::exception("In capture_args: option without a value.");
+			}
+			args_map[MAP_CHUNK_SIZE] = argv[++i];
+		}
+		else if (!strcmp(argv[i], MAP_RANGE_OPT))
+		{
+			unsigned long long first, last;
+			if (i + 1 >= argc || !parse_text_range(argv[i + 1], first, last))
+			{
+				std::cout << "Missing or invalid value for " << argv[i] << ". See usage info." << std::endl;
+				throw std::exception("In capture_args: option without a value.");
+			}
+			args_map[MAP_RANGE] = argv[++i];
+		}
+		else if (!strcmp(argv[i], MAP_CIPHER_OPT))
+		{
+			if (i + 1 >= argc || (strcmp(argv[i + 1], CIPHER_CFB) && strcmp(argv[i + 1], CIPHER_CTR)))
+			{
+				std::cout << "Missing or invalid value for " << argv[i] << ". See usage info." << std::endl;
+				throw std::exception("In capture_args: option without a value.");
+			}
+			args_map[MAP_CIPHER] = argv[++i];
+		}
+		else if (!strcmp(argv[i], MAP_TRUSTED_INPUT_OPT))
+			args_map[MAP_TRUSTED_INPUT] = MAP_TRUSTED_INPUT_OPT;
+		else if (!strcmp(argv[i], MAP_USE_ALPHA_OPT))
+			args_map[MAP_USE_ALPHA] = MAP_USE_ALPHA_OPT;
+		else if (!strcmp(argv[i], MAP_COMPRESS_TEXT_OPT))
+			args_map[MAP_COMPRESS_TEXT] = MAP_COMPRESS_TEXT_OPT;
+		else if (!strcmp(argv[i], MAP_CARRIER_POOL_OPT))
+			args_map[MAP_CARRIER_POOL] = MAP_CARRIER_POOL_OPT;
+		else
+			positional_args.push_back(argv[i]);
+	}
+	argc = (int)positional_args.size();
+	argv = &positional_args[0];
+
+	// If invoked with no parameters...
+	if (argc < 2)
+	{
+		display_usage_info();
+		throw std::exception("In capture_args: help requested. No further processing required.");
+	}
+
+	// Or if the second parameter is asking for help...
+	if (argv[n + 1] == "help" || argv[n + 1] == "?" ||
+		argv[n + 1] == "/help" || argv[n + 1] == "/?")
+	{
+		display_usage_info();
+		throw std::exception("In capture_args: help requested. No further processing required.");
+	}
+
+	// A batch only needs the job file
+	if (argc == 3 && !strcmp(argv[n + 1], MAP_BATCH_OPERATION_NAME))
+	{
+		args_map[MAP_BINARY_PATH] = argv[n];
+		args_map[MAP_OPERATION_TYPE] = argv[n + 1];
+		args_map[MAP_JOB_FILENAME] = argv[n + 2];
+		return;
+	}
+
+	// Sharding takes a list or directory of images in place of one, and doesn't use XOR
+	if (!strcmp(argv[n + 1], MAP_SHARD_OPERATION_NAME) || !strcmp(argv[n + 1], MAP_UNSHARD_OPERATION_NAME))
+	{
+		bool shard = !strcmp(argv[n + 1], MAP_SHARD_OPERATION_NAME);
+		if (argc != (shard ? 5 : 4) && argc != (shard ? 6 : 5))
+		{
+			std::cout << "Wrong number of arguments for " << argv[n + 1] << ". See usage info." << std::endl;
+			throw std::exception("In capture_args: wrong number of arguments provided.");
+		}
+		args_map[MAP_BINARY_PATH] = argv[n];
+		args_map[MAP_OPERATION_TYPE] = argv[n + 1];
+		if (shard)
+		{
+			args_map[MAP_PLAINTEXT_FILENAME] = argv[n + 2];
+			args_map[MAP_REF_IMAGE_FILENAME] = argv[n + 3];
+			args_map[MAP_CIPHER_IMAGE_FILENAME] = argv[n + 4];
+		}
+		else
+		{
+			args_map[MAP_CIPHER_IMAGE_FILENAME] = argv[n + 2];
+			args_map[MAP_PLAINTEXT_FILENAME] = argv[n + 3];
+		}
+		if (argc == (shard ? 6 : 5)) // Optional password
+			args_map[MAP_PASSWORD_STRING] = argv[argc - 1];
+		check_stdin_inputs(args_map);
+		return;
+	}
+
+	if (argc < 4)
+	{
+		std::cout << "Too few arguments provided. See usage info." << std::endl;
+		std::cout << std::endl;
+		display_usage_info();
+		throw std::exception("In capture_args: too few arguments provided.");
+	}
+
+	try
 	{		
 		// The first argument is always the absolute path to the binary
 		args_map[MAP_BINARY_PATH] = argv[n];
@@ -403,6 +1212,7 @@ void capture_args(int argc, char** argv,
 	{
 		throw std::exception("Exception in capture_args attempting to place the arguments into the argument list.");
 	}
+	check_stdin_inputs(args_map);
 }
 
 void display_usage_info()
@@ -422,6 +1232,73 @@ void display_usage_info()
 	std::cout << "Decode a text file from an image (using XOR):" << std::endl;
 	std::cout << "\ttsStego.exe decode using_xor cipher_img ref_img textfile" << std::endl;
 	std::cout << std::endl;
+	std::cout << "Run a list of encodes and decodes, one per line of a job file:" << std::endl;
+	std::cout << "\ttsStego.exe batch job_file" << std::endl;
+	std::cout << std::endl;
+	std::cout << "Spread a text file across several images, each holding a shard of it:" << std::endl;
+	std::cout << "\ttsStego.exe shard textfile carriers cipher_prefix" << std::endl;
+	std::cout << std::endl;
+	std::cout << "Put a text file back together from the images holding its shards:" << std::endl;
+	std::cout << "\ttsStego.exe unshard cipher_imgs textfile" << std::endl;
+	std::cout << std::endl;
+	std::cout << "OPTIONS" << std::endl;
+	std::cout << "-------" << std::endl;
+	std::cout << "--level store|fast|default|max|auto[:ms]" << std::endl;
+	std::cout << "\tHow hard to compress the cipher image. \"store\" writes it uncompressed" << std::endl;
+	std::cout << "\tand \"max\" makes it as small as possible. \"auto\" picks the smallest" << std::endl;
+	std::cout << "\toutput that encodes within ms milliseconds per megapixel (default 250)." << std::endl;
+	std::cout << std::endl;
+	std::cout << "--segments n" << std::endl;
+	std::cout << "\tWrite the cipher image as n independently compressed strips of rows so" << std::endl;
+	std::cout << "\tthat decode can use n cores. Other PNG readers still open it normally." << std::endl;
+	std::cout << std::endl;
+	std::cout << "--density 1|2|3|4" << std::endl;
+	std::cout << "\tEmbed the text in that many low bits of every color channel, instead" << std::endl;
+	std::cout << "\tof 8 bits per pixel split 3-2-3. Higher packs the text into fewer" << std::endl;
+	std::cout << "\tpixels but changes each one more. Decode finds it out by itself." << std::endl;
+	std::cout << std::endl;
+	std::cout << "--use-alpha" << std::endl;
+	std::cout << "\tAlso embed the text in the alpha channel, if the image has one." << std::endl;
+	std::cout << std::endl;
+	std::cout << "--compress-text" << std::endl;
+	std::cout << "\tCompress the text before it's encrypted, so it takes fewer pixels." << std::endl;
+	std::cout << "\tLeft as it is if that doesn't make it smaller. Decode undoes it." << std::endl;
+	std::cout << std::endl;
+	std::cout << "--chunk-size size[K|M|G]" << std::endl;
+	std::cout << "\tSplit the text into chunks of that size, each compressed and encrypted" << std::endl;
+	std::cout << "\ton its own, so that decode --range only has to read the ones it needs." << std::endl;
+	std::cout << std::endl;
+	std::cout << "--cipher cfb|ctr" << std::endl;
+	std::cout << "\tThe AES mode to encrypt the text in, CFB by default. CTR encrypts and" << std::endl;
+	std::cout << "\tdecrypts big texts on all cores, and lets --range decrypt just the" << std::endl;
+	std::cout << "\tpart it needs. Decode finds it out by itself." << std::endl;
+	std::cout << std::endl;
+	std::cout << "--range first:[last]" << std::endl;
+	std::cout << "\tFor decode, write only bytes first up to (not including) last of the" << std::endl;
+	std::cout << "\ttext, or to the end with no last. Fastest if encoded with --chunk-size" << std::endl;
+	std::cout << "\tor --cipher ctr." << std::endl;
+	std::cout << std::endl;
+	std::cout << "--carrier-pool" << std::endl;
+	std::cout << "\tFor encode, ref_img is a directory of carrier images, and the one that" << std::endl;
+	std::cout << "\tcan hold the text (with the other options given, e.g. --density) in the" << std::endl;
+	std::cout << "\tfewest bytes of decoded image (pixels times bytes per pixel) is used." << std::endl;
+	std::cout << "\tThe images' sizes are kept in tsStego_pool.idx there, so only new or" << std::endl;
+	std::cout << "\tchanged ones are looked at." << std::endl;
+	std::cout << std::endl;
+	std::cout << "--stage-threads decode,embed,encode" << std::endl;
+	std::cout << "\tFor batch, shard and unshard, how many threads each of those stages of" << std::endl;
+	std::cout << "\tthe job pipeline gets. By default half the cores each decode and" << std::endl;
+	std::cout << "\tencode, and 1 embed (half the cores for shard and unshard)." << std::endl;
+	std::cout << "\tHow busy each stage was is shown when the batch finishes." << std::endl;
+	std::cout << std::endl;
+	std::cout << "--mem-budget size[K|M|G]" << std::endl;
+	std::cout << "\tFor batch, how much memory the jobs in flight may use between them," << std::endl;
+	std::cout << "\tas estimated from the size of their images. Jobs wait for room." << std::endl;
+	std::cout << std::endl;
+	std::cout << "--trusted-input" << std::endl;
+	std::cout << "\tDecode without verifying the PNG chunk CRCs or the zlib Adler-32. Only" << std::endl;
+	std::cout << "\tfor images from storage that already guarantees their integrity." << std::endl;
+	std::cout << std::endl;
 	std::cout << "GLOSSARY" << std::endl;
 	std::cout << "--------" << std::endl;
 	std::cout << "\"encode\" means take the text from the text file and create a new cipher" << std::endl;
@@ -441,6 +1318,24 @@ void display_usage_info()
 	std::cout << std::endl;
 	std::cout << "\"cipher_img\" is the filename of a PNG image for encode or decode to/from" << std::endl;
 	std::cout << std::endl;
+	std::cout << "Any of textfile, ref_img and cipher_img can be - for stdin (when read) or" << std::endl;
+	std::cout << "\tstdout (when written), e.g. tsStego.exe encode - ref.png - < in.txt > out.png" << std::endl;
+	std::cout << "\tMessages then go to stderr. Only one of the inputs can be stdin, and it's" << std::endl;
+	std::cout << "\tnot available in a job file." << std::endl;
+	std::cout << std::endl;
+	std::cout << "\"carriers\" is a directory of PNG images, or a comma-separated list of" << std::endl;
+	std::cout << "\tthem, for shard to spread the text across in proportion to how much" << std::endl;
+	std::cout << "\teach one holds. Shard i is written to cipher_prefix_i.png." << std::endl;
+	std::cout << std::endl;
+	std::cout << "\"cipher_imgs\" is a directory or comma-separated list of the images" << std::endl;
+	std::cout << "\twritten by shard, in any order. Every one of them is needed. Sharding" << std::endl;
+	std::cout << "\tdoesn't use XOR." << std::endl;
+	std::cout << std::endl;
+	std::cout << "\"job_file\" is a text file with the arguments of one encode or decode per" << std::endl;
+	std::cout << "\tline, e.g. \"encode example.txt irish_stamp.png stego_out.png\". Blank" << std::endl;
+	std::cout << "\tlines and lines starting with # are skipped. Options given with batch" << std::endl;
+	std::cout << "\tapply to every job." << std::endl;
+	std::cout << std::endl;
 }
 
 void display_about_info()
@@ -450,101 +1345,1043 @@ void display_about_info()
 	std::cout << "PNG support provided by Lode Vandevenne" << std::endl;
 }
 
-//		- Load the PNG file into the image data structure [ DONE ] 
-//		- Load the plain text file [ DONE ] 
-//		- Save the image data structure as a new PNG file [ DONE ]
-//		- Save the plain text as a new text file [ DONE ]
-//		- Handle command line input [ DONE ]
-//		- Display usage information [ DONE ]
-//		- Merge the cipher text into the image data structure [ DONE ]
-//		- Load the enciphered PNG file into the enciphered image data structure [ DONE ] 
-//		- Extract the cipher text from the enciphered image data structure [ DONE ]
-//		- Encipher from plain text [ DONE ]
-//		- Decipher to plain text [ DONE ]
-//		- Add command line option to pass the encryption key to be used [ DONE ]
-int main(int argc, char** argv)
+// Everything an encode or decode carries from one step to the next
+// The steps are split up this way so a batch can run them as the stages of a pipeline (see run_batch)
+struct stego_job
 {
-	display_about_info();
+	std::map<unsigned int, std::string> args;
+	std::string line; // The job file line, for a batch
+	bool failed;
+	std::string error; // Why it failed, after which the remaining steps are skipped
+
+	std::vector<unsigned char> text; // The plain text read for an encode, or recovered by a decode
+	std::vector<unsigned char> png; // The carrier (encode) or cipher image (decode) file
+	std::vector<unsigned char> ref_png; // The reference image file, for an XOR decode
+	std::vector<unsigned char> image;
+	std::vector<unsigned char> ref_image;
+	unsigned int width, height;
+	lodepng::State png_state;
+	lodepng::State ref_png_state;
+	unsigned int skipped_checks; // See --trusted-input
+	std::vector<unsigned char> output; // The cipher image or text file to write
+	std::vector<unsigned char> salt; // For an encode in a batch, the key derivation salt all its encodes share
+	payload_header header; // For a shard, the header it's embedded with (shard) or was found with (unshard)
+	size_t inputs_read; // How many of its input files (in get_job_files order) reading has got to
+
+	stego_job() : failed(false), width(0), height(0), skipped_checks(0), inputs_read(0) {}
+
+	bool is_encode() { return args[MAP_OPERATION_TYPE] == MAP_ENCODE_OPERATION_NAME; }
+	bool is_xor() { return args[MAP_USING_XOR] == MAP_USING_XOR_STR; }
+	const std::string& output_filename() { return args[is_encode() ? MAP_CIPHER_IMAGE_FILENAME : MAP_PLAINTEXT_FILENAME]; }
+};
+
+// The header an encode embeds ahead of its text, with the density asked for on the command line
+payload_header get_job_header(stego_job& job)
+{
+	payload_header header;
+	if (job.args[MAP_DENSITY].size())
+	{
+		header.bits_per_slot = atoi(job.args[MAP_DENSITY].c_str());
+		header.flags |= PAYLOAD_FLAG_DENSITY;
+	}
+	if (job.args[MAP_USE_ALPHA] == MAP_USE_ALPHA_OPT)
+		header.flags |= PAYLOAD_FLAG_ALPHA;
+	if (job.args[MAP_COMPRESS_TEXT] == MAP_COMPRESS_TEXT_OPT)
+		header.flags |= PAYLOAD_FLAG_COMPRESSED;
+	if (job.args[MAP_CHUNK_SIZE].size())
+		header.flags |= PAYLOAD_FLAG_CHUNKED;
+	if (job.args[MAP_CIPHER] == CIPHER_CTR)
+		header.flags |= PAYLOAD_FLAG_CTR;
+	return header;
+}
+
+// For --carrier-pool: use the carrier in the ref_img directory that can hold the text with the fewest
+// bytes of decoded image, so no time goes on decoding and encoding pixels that carry nothing
+// Text that's going to be compressed is taken at its full size, as how small it gets isn't known until
+// it's embedded
+// Throws std::exception if none of them are big enough
+void choose_pool_carrier(stego_job& job)
+{
+	std::vector<carrier_info> pool;
+	get_carrier_pool(job.args[MAP_REF_IMAGE_FILENAME], pool);
+
+	payload_header header = get_job_header(job);
+	unsigned long long payload_size = job.text.size();
+	if (header.flags & PAYLOAD_FLAG_CHUNKED)
+		payload_size = chunked_payload_bound(job.text.size(), parse_memory_size(job.args[MAP_CHUNK_SIZE]));
+
+	const carrier_info* best = NULL;
+	unsigned long long best_bytes = 0;
+	for (auto& carrier : pool)
+	{
+		LodePNGColorMode png_mode, raw_mode;
+		lodepng_color_mode_init(&png_mode);
+		png_mode.colortype = (LodePNGColorType)carrier.colortype;
+		png_mode.bitdepth = carrier.bitdepth;
+		png_mode.key_defined = carrier.color_key;
+		lodepng_color_mode_init(&raw_mode); // RGBA8, unless the image is embedded natively
+		if (carrier_capacity_bytes(carrier.width, carrier.height, png_mode, header) < payload_size)
+			continue;
+		unsigned long long image_bytes = (unsigned long long)carrier.width * carrier.height *
+			lodepng_get_bpp(is_native_embeddable(png_mode) ? &png_mode : &raw_mode) / 8;
+		if (!best || image_bytes < best_bytes)
+		{
+			best = &carrier;
+			best_bytes = image_bytes;
+		}
+	}
+	if (!best)
+		throw std::exception("Exception in choose_pool_carrier: no image in the carrier pool is big enough for the text");
+	job.args[MAP_REF_IMAGE_FILENAME] = best->filename;
+}
+
+// Step 1: read the input files
+// For an encode, the carrier is also checked against the text before anything else is done with either
+// With --carrier-pool, the carrier is chosen once the text has been read
+void read_job_files(stego_job& job)
+{
+	if (job.is_encode())
+	{
+		job.inputs_read++;
+		read_text_file(job.args[MAP_PLAINTEXT_FILENAME].c_str(), job.text);
+		if (job.args[MAP_CARRIER_POOL] == MAP_CARRIER_POOL_OPT)
+			choose_pool_carrier(job);
+		job.inputs_read++;
+		job.png = async_io_read(job.args[MAP_REF_IMAGE_FILENAME]);
+
+		// The cipher text is the same size as the plain text, so the carrier can be checked
+		// against the plain text before we spend any time encrypting or decoding
+		// Text that's going to be compressed or chunked can only be checked once it has been, when
+		// it's embedded
+		inspect_png(job.png, job.width, job.height, job.png_state);
+		job.png_state.info_png.color.key_defined = has_trns_chunk(job.png); // Embedded as RGBA8 if so
+		payload_header header = get_job_header(job);
+		if (!(header.flags & (PAYLOAD_FLAG_COMPRESSED | PAYLOAD_FLAG_CHUNKED)) && 
+			carrier_capacity_bytes(job.width, job.height, job.png_state.info_png.color, header) < job.text.size())
+			throw std::exception("Exception in main: image is too small to fit all the text");
+	}
+	else
+	{
+		job.inputs_read++;
+		job.png = async_io_read(job.args[MAP_CIPHER_IMAGE_FILENAME]);
+		job.inputs_read++;
+		if (job.is_xor())
+			job.ref_png = async_io_read(job.args[MAP_REF_IMAGE_FILENAME]);
+	}
+}
+
+// Step 1 for a shard: read its carrier
+void read_job_carrier(stego_job& job)
+{
+	job.png = async_io_read(job.args[MAP_REF_IMAGE_FILENAME]);
+}
+
+// Step 2: decode the carrier, or the cipher image (and reference image)
+void decode_job_images(stego_job& job)
+{
+	if (job.is_encode())
+	{
+		decode_png(job.png, job.image, job.width, job.height, job.png_state);
+		std::vector<unsigned char>().swap(job.png);
+		return;
+	}
 
-	std::map<unsigned char, std::string>cmd_args;
+	bool trusted_input = job.args[MAP_TRUSTED_INPUT] == MAP_TRUSTED_INPUT_OPT;
+	if (trusted_input)
+		set_trusted_input(job.png_state);
 
+	if (job.is_xor())
+	{
+		// The cipher and reference images don't depend on each other, so decode the 
+		// reference image on a second thread while this one decodes the cipher image
+		unsigned int ref_w = 0, ref_h = 0;
+		if (trusted_input)
+			set_trusted_input(job.ref_png_state);
+		std::future<unsigned int> ref_decode = std::async(std::launch::async, decode_png,
+			std::cref(job.ref_png), std::ref(job.ref_image), std::ref(ref_w), std::ref(ref_h),
+			std::ref(job.ref_png_state));
+		try
+		{
+			job.skipped_checks += decode_png(job.png, job.image, job.width, job.height, job.png_state);
+		}
+		catch (...)
+		{
+			ref_decode.wait(); // It's still using the job
+			throw;
+		}
+		job.skipped_checks += ref_decode.get(); // Rethrows any exception from the reference image decode
+
+		// An expanded (e.g. palette) reference may have been written back by lodepng in a different
+		// color type, so bring the cipher image into the reference's layout before comparing them
+		if (job.png_state.info_raw.colortype != job.ref_png_state.info_raw.colortype ||
+			job.png_state.info_raw.bitdepth != job.ref_png_state.info_raw.bitdepth)
+		{
+			if (job.width != ref_w || job.height != ref_h)
+				throw std::exception("Exception in main: reference image dimensions don't match the cipher image");
+			std::vector<unsigned char> converted((size_t)job.width * job.height * lodepng_get_bpp(&job.ref_png_state.info_raw) / 8);
+			unsigned int error = lodepng_convert(&converted[0], &job.image[0], &job.ref_png_state.info_raw,
+				&job.png_state.info_raw, job.width, job.height);
+			if (error)
+				throw std::exception(lodepng_error_text(error));
+			job.image.swap(converted);
+		}
+	}
+	else
+		job.skipped_checks += decode_png(job.png, job.image, job.width, job.height, job.png_state);
+	std::vector<unsigned char>().swap(job.png);
+	std::vector<unsigned char>().swap(job.ref_png);
+}
+
+// The key a payload was encrypted with: derived from the password when the header says so, and otherwise
+// (payloads embedded before there was key derivation) the password itself
+// Derived keys are cached in crypto.cpp, so a batch sharing a password and salt only derives it once
+std::string job_key(stego_job& job, const payload_header& header)
+{
+	if (job.args[MAP_PASSWORD_STRING].size() == 0)
+		job.args[MAP_PASSWORD_STRING] = "mysupersecretpasswordthatnobodywouldguess";
+	if (header.flags & PAYLOAD_FLAG_KDF)
+		return openssl_derive_key(job.args[MAP_PASSWORD_STRING], header.salt, header.kdf_iterations);
+	return job.args[MAP_PASSWORD_STRING];
+}
+
+// A job_key, wiped when it goes out of scope, even if encrypting or decrypting with it throws
+struct wiped_job_key
+{
+	std::string value;
+
+	wiped_job_key(stego_job& job, const payload_header& header) : value(job_key(job, header)) {}
+	~wiped_job_key() { openssl_wipe_key(value); }
+};
+
+// Encrypt or decrypt size bytes of an unchunked text, offset bytes into it, in the mode and with the IV
+// recorded in its header
+// Texts embedded before there was an IV in the header used the fixed one
+// An offset other than 0 is only possible in CTR mode
+void crypt_job_text(stego_job& job, const payload_header& header, const unsigned char* input, unsigned char* output,
+	size_t size, unsigned long long offset, bool encrypt)
+{
+	unsigned char iv[16];
+	openssl_aes_chunk_iv((header.flags & PAYLOAD_FLAG_IV) ? header.iv : NULL, 0, iv);
+	wiped_job_key key(job, header);
+	if (header.flags & PAYLOAD_FLAG_CTR)
+		openssl_aes_ctr(key.value, iv, input, output, size, offset);
+	else
+		openssl_aes_cfb(key.value, iv, input, output, size, encrypt);
+}
+
+// Encrypt the job's text into the payload to embed, setting up the header with a fresh IV and key
+// derivation salt, and clearing PAYLOAD_FLAG_COMPRESSED if compression didn't help
+void encrypt_job_text(stego_job& job, payload_header& header, std::vector<unsigned char>& cypher_text)
+{
+	openssl_random_iv(header.iv);
+	header.flags |= PAYLOAD_FLAG_IV;
+	if (job.salt.size() == KDF_SALT_BYTES)
+		memcpy(header.salt, &job.salt[0], KDF_SALT_BYTES);
+	else
+		openssl_random_salt(header.salt);
+	header.kdf_iterations = KDF_ITERATIONS;
+	header.flags |= PAYLOAD_FLAG_KDF;
+	if (header.flags & PAYLOAD_FLAG_CHUNKED)
+	{
+		// Each chunk is compressed and encrypted on its own, and records whether it was compressed
+		wiped_job_key key(job, header);
+		build_chunked_payload(key.value, job.text, (size_t)parse_memory_size(job.args[MAP_CHUNK_SIZE]),
+			(header.flags & PAYLOAD_FLAG_COMPRESSED) != 0, (header.flags & PAYLOAD_FLAG_CTR) != 0, header.iv, cypher_text);
+		header.flags &= ~PAYLOAD_FLAG_COMPRESSED;
+		return;
+	}
+
+	if (header.flags & PAYLOAD_FLAG_COMPRESSED)
+	{
+		std::vector<unsigned char> compressed;
+		if (compress_text(job.text.empty() ? NULL : &job.text[0], job.text.size(), compressed))
+			job.text.swap(compressed);
+		else
+			header.flags &= ~PAYLOAD_FLAG_COMPRESSED; // Embed it as it is
+	}
+	cypher_text.resize(job.text.size());
+	if (!job.text.empty())
+		crypt_job_text(job, header, &job.text[0], &cypher_text[0], job.text.size(), 0, true);
+}
+
+// Decrypt the text (or the --range of it) from a payload of header.length bytes, read through read
+// The job's images are let go as soon as everything needed has been read from them
+void decrypt_job_text(stego_job& job, const payload_header& header, const payload_reader& read)
+{
+	unsigned long long first = 0, last = ULLONG_MAX;
+	if (job.args[MAP_RANGE].size())
+		parse_text_range(job.args[MAP_RANGE], first, last);
+
+	std::vector<unsigned char> cypher_text;
+	if (header.flags & PAYLOAD_FLAG_CHUNKED)
+	{
+		// Only the chunks holding the range are extracted and decrypted
+		wiped_job_key key(job, header);
+		read_chunked_payload(key.value, header.length, read, first, last, 
+			(header.flags & PAYLOAD_FLAG_CTR) != 0, job.text);
+		std::vector<unsigned char>().swap(job.image);
+		std::vector<unsigned char>().swap(job.ref_image);
+		return;
+	}
+
+	if ((header.flags & PAYLOAD_FLAG_CTR) && !(header.flags & PAYLOAD_FLAG_COMPRESSED))
+	{
+		// CTR can decrypt any part of the text on its own, so only the range is extracted
+		if (last > header.length)
+			last = header.length;
+		if (first > last)
+			first = last;
+		cypher_text.resize((size_t)(last - first));
+		if (!cypher_text.empty())
+			read((size_t)first, cypher_text.size(), &cypher_text[0]);
+		std::vector<unsigned char>().swap(job.image);
+		std::vector<unsigned char>().swap(job.ref_image);
+
+		job.text.resize(cypher_text.size());
+		if (!cypher_text.empty())
+			crypt_job_text(job, header, &cypher_text[0], &job.text[0], cypher_text.size(), first, false);
+		return;
+	}
+
+	cypher_text.resize((size_t)header.length);
+	if (!cypher_text.empty())
+		read(0, cypher_text.size(), &cypher_text[0]);
+	std::vector<unsigned char>().swap(job.image);
+	std::vector<unsigned char>().swap(job.ref_image);
+	if (header.flags & (PAYLOAD_FLAG_CTR | PAYLOAD_FLAG_IV))
+	{
+		job.text.resize(cypher_text.size());
+		if (!cypher_text.empty())
+			crypt_job_text(job, header, &cypher_text[0], &job.text[0], cypher_text.size(), 0, false);
+	}
+	else
+		openssl_aes_decrypt(wiped_job_key(job, header).value, cypher_text, job.text); // Embedded before there were IVs
+	if (header.flags & PAYLOAD_FLAG_COMPRESSED)
+	{
+		std::vector<unsigned char> compressed;
+		compressed.swap(job.text);
+		decompress_text(compressed.empty() ? NULL : &compressed[0], compressed.size(), job.text);
+	}
+
+	// Without chunks, the whole text has to be decrypted to get at any of it
+	if (last < job.text.size())
+		job.text.resize((size_t)last);
+	if (first > 0)
+		job.text.erase(job.text.begin(), job.text.begin() + (size_t)(first < job.text.size() ? first : job.text.size()));
+}
+
+// Step 3: encrypt the text and embed it into the image, or extract the text and decrypt it
+void embed_job_text(stego_job& job)
+{
+	if (job.is_encode())
+	{
+		payload_header header = get_job_header(job);
+		std::vector<unsigned char> cypher_text;
+		encrypt_job_text(job, header, cypher_text);
+		embed_layout layout = get_embed_layout(job.png_state.info_raw);
+		const unsigned char* cypher_data = cypher_text.empty() ? NULL : &cypher_text[0];
+		if (job.is_xor())
+			merge_text_into_img_data(header, cypher_data, cypher_text.size(), job.image, layout, true); // Using XOR flag
+		else
+			merge_text_into_img_data(header, cypher_data, cypher_text.size(), job.image, layout); // Not using XOR
+		return;
+	}
+
+	// With XOR, the cipher image has been brought into the reference image's layout (see decode_job_images)
+	embed_layout layout = get_embed_layout(job.is_xor() ? job.ref_png_state.info_raw : job.png_state.info_raw);
+	payload_header header;
+	find_text_in_img_data(job.image, job.ref_image, layout, job.is_xor(), header);
+	if (header.flags & PAYLOAD_FLAG_SHARD)
+		throw std::exception("Exception in embed_job_text: the image holds one shard of a payload, see unshard");
+	payload_reader read = [&](size_t offset, size_t count, unsigned char* bytes)
+	{
+		recover_text_from_img_data(job.image, job.ref_image, layout, job.is_xor(), header, offset, count, bytes);
+	};
+	decrypt_job_text(job, header, read);
+}
+
+// Step 3 for a shard: embed its part of the payload, which run_shard has already encrypted
+void embed_job_shard(stego_job& job)
+{
+	embed_layout layout = get_embed_layout(job.png_state.info_raw);
+	merge_text_into_img_data(job.header, job.text.empty() ? NULL : &job.text[0], job.text.size(), job.image, layout);
+	std::vector<unsigned char>().swap(job.text);
+}
+
+// Step 3 for unshard: extract the shard of the payload in the image, for run_unshard to put together
+void extract_job_shard(stego_job& job)
+{
+	embed_layout layout = get_embed_layout(job.png_state.info_raw);
+	find_text_in_img_data(job.image, job.ref_image, layout, false, job.header);
+	if (!(job.header.flags & PAYLOAD_FLAG_SHARD))
+		throw std::exception("Exception in extract_job_shard: the image doesn't hold a shard");
+	job.text.resize((size_t)job.header.length);
+	if (!job.text.empty())
+		recover_text_from_img_data(job.image, job.ref_image, layout, false, job.header, 0, job.text.size(), &job.text[0]);
+	std::vector<unsigned char>().swap(job.image);
+}
+
+// Step 4: compress the cipher image, or lay out the text file
+void encode_job_output(stego_job& job)
+{
+	if (!job.is_encode())
+	{
+		encode_text_file(job.text, job.output);
+		return;
+	}
+
+	if (job.args[MAP_COMPRESSION_LEVEL].size())
+		apply_compression_level(job.args[MAP_COMPRESSION_LEVEL], job.png_state, job.image, job.width, job.height);
+	unsigned int segments = 1;
+	if (job.args[MAP_SEGMENTS].size())
+		segments = atoi(job.args[MAP_SEGMENTS].c_str());
+	encode_png(job.output, job.image, job.width, job.height, job.png_state, segments);
+	std::vector<unsigned char>().swap(job.image);
+}
+
+// Step 5: write the output file (see async_io.cpp), waiting for it so a failed write fails the job
+// In a batch this is the write stage, which has a thread of its own, so the other stages carry on meanwhile
+void write_job_output(stego_job& job)
+{
+	async_io_write(job.output_filename(), job.output).get();
+}
+
+// Roughly the most memory a job will hold at once, from the PNG headers of its images, for --mem-budget
+// Decoding holds the PNG file, the inflated scanlines and the image at once, and encoding holds the image,
+// its filtered scanlines and the compressed result, each of them taken to be about the size of the image
+// An image that can't be inspected counts as nothing, as the job will fail when it's read anyway
+unsigned long long estimate_job_memory(stego_job& job)
+{
+	std::vector<std::string> images;
+	if (!job.is_encode() || job.args[MAP_CARRIER_POOL] != MAP_CARRIER_POOL_OPT) // A pool's carrier isn't known yet
+		images.push_back(job.args[job.is_encode() ? MAP_REF_IMAGE_FILENAME : MAP_CIPHER_IMAGE_FILENAME]);
+	if (!job.is_encode() && job.is_xor())
+		images.push_back(job.args[MAP_REF_IMAGE_FILENAME]);
+
+	unsigned long long estimate = 0;
+	for (auto& filename : images)
+	{
+		unsigned int width = 0, height = 0;
+		lodepng::State state;
+		std::vector<unsigned char> header = async_io_peek(filename, 33);
+		if (header.size() < 33 || lodepng_inspect(&width, &height, &state, &header[0], header.size()))
+			continue;
+		state.info_png.color.key_defined = peek_trns_chunk(filename); // Decoded as RGBA8 if so
+
+		LodePNGColorMode raw_mode;
+		lodepng_color_mode_init(&raw_mode); // RGBA8, unless the image is embedded natively
+		const LodePNGColorMode& mode = is_native_embeddable(state.info_png.color) ? state.info_png.color : raw_mode;
+		unsigned long long image_bytes = (unsigned long long)width * height * lodepng_get_bpp(&mode) / 8 + height;
+		estimate += (job.is_encode() ? 4 : 3) * image_bytes;
+	}
+	return estimate;
+}
+
+// Run one step of a job unless an earlier one failed, noting why it failed if it does
+void run_job_step(void (*step)(stego_job&), stego_job& job)
+{
+	if (job.failed)
+		return;
 	try
 	{
-		capture_args(argc, argv, cmd_args);
+		step(job);
 	}
 	catch (std::exception const& e)
 	{
-		//std::cout << e.what() << std::endl;
-		return -1;
+		job.failed = true;
+		job.error = e.what();
 	}
-	
-	std::vector<unsigned char> plain_text;
-	std::vector<unsigned char> cypher_text;
-	std::vector<unsigned char> img_data;
-	unsigned int h, w;
+}
 
-	std::vector<unsigned char> modified_img_data;
-	std::vector<unsigned char> ref_img_data;
-	std::vector<unsigned char> modified_text_data;
-	
-	if (cmd_args[MAP_OPERATION_TYPE] == MAP_ENCODE_OPERATION_NAME)
+// Carry out one encode or decode
+// Returns false if it failed, after saying why
+bool run_job(std::map<unsigned int, std::string>& cmd_args)
+{
+	stego_job job;
+	job.args = cmd_args;
+
+	std::cout << std::endl;
+	if (job.is_encode())
 	{
-		std::cout << std::endl;
 		std::cout << "Encoding " << cmd_args[MAP_PLAINTEXT_FILENAME].c_str() << " into ";
 		std::cout << cmd_args[MAP_REF_IMAGE_FILENAME].c_str() << std::endl;
 		std::cout << "to produce the output file: " << cmd_args[MAP_CIPHER_IMAGE_FILENAME].c_str() << std::endl;
-		std::cout << std::endl;
+	}
+	else
+	{
+		std::cout << "Decoding " << cmd_args[MAP_CIPHER_IMAGE_FILENAME].c_str() << std::endl;
+		std::cout << "to produce the output file: " << cmd_args[MAP_PLAINTEXT_FILENAME].c_str() << std::endl;
+		if (job.is_xor())
+			std::cout << "Using XOR with this image: " << cmd_args[MAP_REF_IMAGE_FILENAME].c_str() << std::endl;
+	}
+	std::cout << std::endl;
 
-		try
+	run_job_step(read_job_files, job);
+	run_job_step(decode_job_images, job);
+	run_job_step(embed_job_text, job);
+	run_job_step(encode_job_output, job);
+	run_job_step(write_job_output, job);
+
+	if (!job.failed && !job.is_encode() && job.args[MAP_TRUSTED_INPUT] == MAP_TRUSTED_INPUT_OPT)
+		std::cout << "Trusted input: skipped verification of " << job.skipped_checks << " checksums" << std::endl;
+	if (!job.failed && job.is_encode() && job.args[MAP_CARRIER_POOL] == MAP_CARRIER_POOL_OPT)
+		std::cout << "Carrier from the pool: " << job.args[MAP_REF_IMAGE_FILENAME] << std::endl;
+	if (job.failed)
+		std::cout << job.error << std::endl;
+	return !job.failed;
+}
+
+// The files a job reads and writes, for deciding what to prefetch and which jobs have to wait for others
+void get_job_files(std::map<unsigned int, std::string>& job_args, 
+	std::vector<std::string>& inputs, std::vector<std::string>& outputs)
+{
+	if (job_args[MAP_OPERATION_TYPE] == MAP_ENCODE_OPERATION_NAME)
+	{
+		inputs.push_back(job_args[MAP_PLAINTEXT_FILENAME]);
+		if (job_args[MAP_CARRIER_POOL] != MAP_CARRIER_POOL_OPT) // Not known until the text has been read
+			inputs.push_back(job_args[MAP_REF_IMAGE_FILENAME]);
+		outputs.push_back(job_args[MAP_CIPHER_IMAGE_FILENAME]);
+	}
+	else if (job_args[MAP_OPERATION_TYPE] == MAP_DECODE_OPERATION_NAME)
+	{
+		inputs.push_back(job_args[MAP_CIPHER_IMAGE_FILENAME]);
+		if (job_args[MAP_USING_XOR] == MAP_USING_XOR_STR)
+			inputs.push_back(job_args[MAP_REF_IMAGE_FILENAME]);
+		outputs.push_back(job_args[MAP_PLAINTEXT_FILENAME]);
+	}
+}
+
+// The threads for the decode, embed and encode stages of a job pipeline: from --stage-threads, or by
+// default half the cores each for decode and encode and embed_threads (0 for as many as those) for embed
+// Returns false, after saying so, if --stage-threads isn't valid
+bool get_stage_threads(std::map<unsigned int, std::string>& args, unsigned int embed_threads, unsigned int* stage_threads)
+{
+	unsigned int cores = std::thread::hardware_concurrency();
+	stage_threads[0] = stage_threads[2] = cores > 3 ? cores / 2 : 1;
+	stage_threads[1] = embed_threads ? embed_threads : stage_threads[0];
+	if (args[MAP_STAGE_THREADS].size())
+	{
+		std::istringstream counts(args[MAP_STAGE_THREADS]);
+		for (int i = 0; i < 3; i++)
 		{
-			read_text_file(cmd_args[MAP_PLAINTEXT_FILENAME].c_str(), plain_text);
-			if (cmd_args[MAP_PASSWORD_STRING].size() == 0)
-				cmd_args[MAP_PASSWORD_STRING] = "mysupersecretpasswordthatnobodywouldguess";
-			openssl_aes_encrypt(cmd_args[MAP_PASSWORD_STRING].c_str(), plain_text, cypher_text);
-			read_png_from_file(cmd_args[MAP_REF_IMAGE_FILENAME].c_str(), img_data, w, h);
-			if (cmd_args[MAP_USING_XOR] == MAP_USING_XOR_STR)
-				merge_text_into_img_data(cypher_text, img_data, true); // Using XOR flag
-			else
-				merge_text_into_img_data(cypher_text, img_data); // Not using XOR
-			write_png_to_file(cmd_args[MAP_CIPHER_IMAGE_FILENAME].c_str(), img_data, w, h);
+			int count = 0;
+			char comma;
+			if (!(counts >> count) || count < 1 || (i < 2 && !(counts >> comma)))
+			{
+				std::cout << "Invalid value for " << MAP_STAGE_THREADS_OPT << ". See usage info." << std::endl;
+				return false;
+			}
+			stage_threads[i] = count;
 		}
-		catch (std::exception const& e)
+	}
+	return true;
+}
+
+// Run every job in the job file, one per line, written just like the command line without the program
+// name (see invocations.txt); blank lines and lines starting with # are skipped
+// Options given with the batch command apply to every job, and options on a line apply to that job only
+// The jobs go through a pipeline (see pipeline.cpp) with a stage for each step of run_job, so several
+// jobs are in flight at once. Reading is done in job file order, the input files of the next few jobs are
+// prefetched, and a job that reads a file an earlier job writes waits for that write to be under way
+// The decode, embed and encode stages get the number of threads in --stage-threads (e.g. 4,1,4), and
+// by default half the cores each for decode and encode
+// With --mem-budget, a job is only started once the estimated memory of the jobs in flight (see 
+// estimate_job_memory) leaves room for it, though a job is always started when none are in flight
+// Returns false if the batch couldn't be run or any of its jobs failed
+bool run_batch(std::map<unsigned int, std::string>& batch_args)
+{
+	std::vector<stego_job> jobs;
+
+	std::ifstream job_file(batch_args[MAP_JOB_FILENAME].c_str());
+	if (!job_file.good())
+	{
+		std::cout << "Unable to open the job file " << batch_args[MAP_JOB_FILENAME] << std::endl;
+		return false;
+	}
+
+	unsigned int stage_threads[3];
+	if (!get_stage_threads(batch_args, 1, stage_threads))
+		return false;
+
+	unsigned long long mem_budget = 0; // No limit
+	if (batch_args[MAP_MEM_BUDGET].size())
+	{
+		mem_budget = parse_memory_size(batch_args[MAP_MEM_BUDGET]);
+		if (mem_budget == 0)
 		{
-			std::cout << e.what() << std::endl;
+			std::cout << "Invalid value for " << MAP_MEM_BUDGET_OPT << ". See usage info." << std::endl;
+			return false;
 		}
-		
 	}
-	else if (cmd_args[MAP_OPERATION_TYPE] == MAP_DECODE_OPERATION_NAME)
+
+	std::string line;
+	unsigned int line_number = 0;
+	while (std::getline(job_file, line))
 	{
-		std::cout << std::endl;
-		std::cout << "Decoding " << cmd_args[MAP_CIPHER_IMAGE_FILENAME].c_str() << std::endl;
-		std::cout << "to produce the output file: " << cmd_args[MAP_PLAINTEXT_FILENAME].c_str() << std::endl;
-		if (cmd_args[MAP_USING_XOR] == MAP_USING_XOR_STR)
-			std::cout << "Using XOR with this image: " << cmd_args[MAP_REF_IMAGE_FILENAME].c_str() << std::endl;
-		std::cout << std::endl;
+		line_number++;
+		std::istringstream words(line);
+		std::vector<std::string> job_words;
+		std::string word;
+		while (words >> word)
+			job_words.push_back(word);
+		if (job_words.empty() || job_words[0][0] == '#')
+			continue;
+
+		std::vector<char*> job_argv;
+		job_argv.push_back(&batch_args[MAP_BINARY_PATH][0]);
+		for (auto& w : job_words)
+			job_argv.push_back(&w[0]);
 
+		stego_job job;
+		static const unsigned int batch_options[] = { MAP_COMPRESSION_LEVEL, MAP_TRUSTED_INPUT, MAP_SEGMENTS,
+			MAP_DENSITY, MAP_USE_ALPHA, MAP_COMPRESS_TEXT, MAP_CHUNK_SIZE, MAP_RANGE,
+			MAP_CIPHER, MAP_CARRIER_POOL };
+		for (auto option : batch_options)
+			if (batch_args.count(option))
+				job.args[option] = batch_args[option];
 		try
 		{
-			read_png_from_file(cmd_args[MAP_CIPHER_IMAGE_FILENAME].c_str(), modified_img_data, w, h);
-			if (cmd_args[MAP_USING_XOR] == MAP_USING_XOR_STR)
+			capture_args((int)job_argv.size(), &job_argv[0], job.args);
+			if (job.args[MAP_OPERATION_TYPE] != MAP_ENCODE_OPERATION_NAME && 
+				job.args[MAP_OPERATION_TYPE] != MAP_DECODE_OPERATION_NAME)
+				throw std::exception("In run_batch: not an encode or decode.");
+
+			// stdin and stdout can't be shared out between jobs
+			std::vector<std::string> files;
+			get_job_files(job.args, files, files);
+			for (auto& file : files)
+				if (file == STDIO_FILENAME)
+					throw std::exception("In run_batch: stdin or stdout in a job file.");
+		}
+		catch (std::exception const&)
+		{
+			std::cout << "Skipping line " << line_number << " of the job file: " << line << std::endl;
+			continue;
+		}
+		job.line = line;
+		jobs.push_back(job);
+	}
+
+	// The encodes of a batch all derive their keys with one salt, so that jobs under the same password
+	// derive it once between them rather than once each
+	std::vector<unsigned char> salt(KDF_SALT_BYTES);
+	openssl_random_salt(&salt[0]);
+	for (auto& job : jobs)
+		job.salt = salt;
+
+	std::vector<std::vector<std::string>> inputs(jobs.size()), outputs(jobs.size());
+	std::vector<std::vector<bool>> prefetched(jobs.size());
+	std::vector<size_t> wait_for(jobs.size(), 0); // One past the last earlier job writing one of this job's inputs
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		get_job_files(jobs[i].args, inputs[i], outputs[i]);
+		prefetched[i].resize(inputs[i].size());
+		for (size_t k = 0; k < i; k++)
+			for (auto& output : outputs[k])
+				for (auto& input : inputs[i])
+					if (output == input)
+						wait_for[i] = k + 1;
+	}
+
+	std::atomic<size_t> written(0); // Jobs through the write stage, which takes them in order
+	unsigned int failed = 0;
+
+	// Estimated memory of the jobs admitted and not yet written, only touched by the read and write stages
+	std::vector<unsigned long long> job_memory(jobs.size(), 0);
+	std::atomic<unsigned long long> memory_in_use(0);
+	unsigned long long memory_peak = 0;
+	unsigned int memory_waits = 0; // Jobs that had to wait for others to finish first
+	bool waiting_for_memory = false;
+
+	std::vector<pipeline_stage> stages(5);
+	stages[0].name = "read";
+	stages[0].run = [&](size_t i)
+	{
+		// Prefetch the inputs of this job and the next few, except files a job still to be written will write
+		for (size_t j = i; j < jobs.size() && j < i + BATCH_PREFETCH_JOBS; j++)
+		{
+			for (size_t f = 0; f < inputs[j].size(); f++)
 			{
-				read_png_from_file(cmd_args[MAP_REF_IMAGE_FILENAME].c_str(), ref_img_data, w, h);
-				extract_text_from_img_data(modified_img_data, ref_img_data, cypher_text, true);
+				bool written_first = false;
+				for (size_t k = written; k < j && !written_first; k++)
+					for (auto& output : outputs[k])
+						written_first = written_first || output == inputs[j][f];
+				if (!prefetched[j][f] && !written_first)
+				{
+					async_io_prefetch(inputs[j][f]);
+					prefetched[j][f] = true;
+				}
 			}
-				
-			else
-				extract_text_from_img_data(modified_img_data, ref_img_data, cypher_text);
-			if (cmd_args[MAP_PASSWORD_STRING].size() == 0)
-				cmd_args[MAP_PASSWORD_STRING] = "mysupersecretpasswordthatnobodywouldguess";
-			openssl_aes_decrypt(cmd_args[MAP_PASSWORD_STRING].c_str(), cypher_text, modified_text_data);
-			write_text_file(cmd_args[MAP_PLAINTEXT_FILENAME].c_str(), modified_text_data);
 		}
-		catch (std::exception const& e)
+
+		run_job_step(read_job_files, jobs[i]);
+
+		// A job that failed before reading all it had prefetched gives the rest back
+		for (size_t f = jobs[i].inputs_read; f < inputs[i].size(); f++)
+			if (prefetched[i][f])
+				async_io_cancel_prefetch(inputs[i][f]);
+	};
+	stages[0].ready = [&](size_t i)
+	{
+		if (written < wait_for[i])
+			return false;
+		if (mem_budget)
 		{
-			std::cout << e.what() << std::endl;
+			if (!job_memory[i])
+				job_memory[i] = estimate_job_memory(jobs[i]) + 1; // Never 0, so it's only worked out once
+			unsigned long long in_use = memory_in_use;
+			if (in_use && in_use + job_memory[i] > mem_budget)
+			{
+				if (!waiting_for_memory)
+					memory_waits++;
+				waiting_for_memory = true;
+				return false;
+			}
+			waiting_for_memory = false;
+			memory_in_use += job_memory[i];
+			if (in_use + job_memory[i] > memory_peak)
+				memory_peak = in_use + job_memory[i];
 		}
+		return true;
+	};
+	stages[1].name = "decode";
+	stages[1].threads = stage_threads[0];
+	stages[1].run = [&](size_t i) { run_job_step(decode_job_images, jobs[i]); };
+	stages[2].name = "embed";
+	stages[2].threads = stage_threads[1];
+	stages[2].run = [&](size_t i) { run_job_step(embed_job_text, jobs[i]); };
+	stages[3].name = "encode";
+	stages[3].threads = stage_threads[2];
+	stages[3].run = [&](size_t i) { run_job_step(encode_job_output, jobs[i]); };
+	stages[4].name = "write";
+	stages[4].ordered = true;
+	stages[4].run = [&](size_t i)
+	{
+		stego_job& job = jobs[i];
+		run_job_step(write_job_output, job);
+
+		std::cout << "Job " << i + 1 << " of " << jobs.size() << ": " << job.line << std::endl;
+		if (job.failed)
+		{
+			std::cout << "\t" << job.error << std::endl;
+			failed++;
+		}
+		else if (!job.is_encode() && job.args[MAP_TRUSTED_INPUT] == MAP_TRUSTED_INPUT_OPT)
+			std::cout << "\tTrusted input: skipped verification of " << job.skipped_checks << " checksums" << std::endl;
+		else if (job.is_encode() && job.args[MAP_CARRIER_POOL] == MAP_CARRIER_POOL_OPT)
+			std::cout << "\tCarrier from the pool: " << job.args[MAP_REF_IMAGE_FILENAME] << std::endl;
+		job = stego_job(); // Let go of everything it held
+		memory_in_use -= job_memory[i];
+		written = i + 1;
+	};
+
+	std::cout << "Running " << jobs.size() << " jobs with " << async_io_backend_name() << " file I/O" << std::endl;
+	std::cout << std::endl;
+	run_pipeline(stages, jobs.size(), BATCH_QUEUE_DEPTH);
+
+	std::cout << std::endl;
+	if (mem_budget)
+	{
+		// In MB, rounded up
+		std::cout << "Memory budget " << ((mem_budget + 0xFFFFF) >> 20) << " MB, most in use (estimated) ";
+		std::cout << ((memory_peak + 0xFFFFF) >> 20) << " MB, " << memory_waits << " jobs waited for memory" << std::endl;
+	}
+	std::cout << "Batch finished: " << jobs.size() - failed << " of " << jobs.size() << " jobs succeeded" << std::endl;
+	return failed == 0;
+}
+
+// Run the jobs for the shards of one payload through a pipeline like run_batch's: the images are read in
+// order, with the next few prefetched, while the ones already read are decoded, embedded and encoded on
+// the stages' threads. Shards being encoded go on through the encode and write stages, and shards being
+// decoded stop once they've been extracted
+// Returns false, after saying which shards failed and why, if any did
+bool run_shard_pipeline(std::vector<stego_job>& jobs, void (*read)(stego_job&), void (*embed)(stego_job&),
+	const unsigned int* stage_threads)
+{
+	auto image_filename = [&](size_t i) -> std::string&
+	{
+		return jobs[i].args[jobs[i].is_encode() ? MAP_REF_IMAGE_FILENAME : MAP_CIPHER_IMAGE_FILENAME];
+	};
+	for (size_t i = 0; i < jobs.size() && i < BATCH_PREFETCH_JOBS; i++)
+		async_io_prefetch(image_filename(i));
+
+	std::vector<pipeline_stage> stages(jobs.empty() || jobs[0].is_encode() ? 5 : 3);
+	stages[0].name = "read";
+	stages[0].run = [&](size_t i)
+	{
+		if (i + BATCH_PREFETCH_JOBS < jobs.size())
+			async_io_prefetch(image_filename(i + BATCH_PREFETCH_JOBS));
+		run_job_step(read, jobs[i]);
+	};
+	stages[1].name = "decode";
+	stages[1].threads = stage_threads[0];
+	stages[1].run = [&](size_t i) { run_job_step(decode_job_images, jobs[i]); };
+	stages[2].name = "embed";
+	stages[2].threads = stage_threads[1];
+	stages[2].run = [&](size_t i) { run_job_step(embed, jobs[i]); };
+	if (stages.size() > 3)
+	{
+		stages[3].name = "encode";
+		stages[3].threads = stage_threads[2];
+		stages[3].run = [&](size_t i) { run_job_step(encode_job_output, jobs[i]); };
+		stages[4].name = "write";
+		stages[4].ordered = true;
+		stages[4].run = [&](size_t i) { run_job_step(write_job_output, jobs[i]); };
+	}
+	run_pipeline(stages, jobs.size(), BATCH_QUEUE_DEPTH);
+
+	bool succeeded = true;
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		if (!jobs[i].failed)
+			continue;
+		std::cout << "Shard " << i << ", " << image_filename(i) << ": " << jobs[i].error << std::endl;
+		succeeded = false;
+	}
+	return succeeded;
+}
+
+// Encrypt the text once, as for an encode, and spread the payload across all the carriers, each one
+// holding a shard of it along with a header saying which shard it is
+// The payload is shared out in proportion to what each carrier can hold (worked out from its PNG header
+// alone), so every carrier is changed about as much as the others and none is left out, then the
+// carriers go through run_shard_pipeline so several of them are embedded at once
+// Shard i is written to cipher_prefix_i.png
+// Returns false if it failed, after saying why
+bool run_shard(std::map<unsigned int, std::string>& cmd_args)
+{
+	unsigned int stage_threads[3];
+	if (!get_stage_threads(cmd_args, 0, stage_threads))
+		return false;
+
+	std::cout << std::endl;
+	std::cout << "Sharding " << cmd_args[MAP_PLAINTEXT_FILENAME].c_str() << " across ";
+	std::cout << cmd_args[MAP_REF_IMAGE_FILENAME].c_str() << std::endl;
+	std::cout << "to produce the output files: " << cmd_args[MAP_CIPHER_IMAGE_FILENAME].c_str() << "_*.png" << std::endl;
+	std::cout << std::endl;
+
+	std::vector<stego_job> jobs;
+	try
+	{
+		std::vector<std::string> carriers;
+		list_png_files(cmd_args[MAP_REF_IMAGE_FILENAME], carriers);
+		if (carriers.empty())
+			throw std::exception("Exception in run_shard: no carrier images found");
+
+		stego_job text_job;
+		text_job.args = cmd_args;
+		read_text_file(cmd_args[MAP_PLAINTEXT_FILENAME].c_str(), text_job.text);
+		payload_header header = get_job_header(text_job);
+		std::vector<unsigned char> payload;
+		encrypt_job_text(text_job, header, payload);
+		std::vector<unsigned char>().swap(text_job.text);
+
+		header.flags |= PAYLOAD_FLAG_SHARD;
+		header.payload_length = payload.size();
+		std::vector<unsigned long long> capacity(carriers.size(), 0);
+		unsigned long long total_capacity = 0;
+		for (size_t i = 0; i < carriers.size(); i++)
+		{
+			unsigned int width = 0, height = 0;
+			lodepng::State state;
+			inspect_png(async_io_peek(carriers[i], 33), width, height, state);
+			state.info_png.color.key_defined = peek_trns_chunk(carriers[i]); // Embedded as RGBA8 if so
+			capacity[i] = carrier_capacity_bytes(width, height, state.info_png.color, header);
+			total_capacity += capacity[i];
+		}
+		if (total_capacity < payload.size())
+			throw std::exception("Exception in run_shard: the carriers are too small to fit all the text");
+
+		// In proportion to capacity, rounded down, then what rounding left over goes to the first
+		// carriers with room for it
+		std::vector<unsigned long long> share(carriers.size(), 0);
+		unsigned long long shared = 0;
+		for (size_t i = 0; i < carriers.size(); i++)
+		{
+			share[i] = (unsigned long long)((double)payload.size() * capacity[i] / total_capacity);
+			if (share[i] > capacity[i])
+				share[i] = capacity[i];
+			shared += share[i];
+		}
+		for (size_t i = 0; i < carriers.size() && shared < payload.size(); i++)
+		{
+			unsigned long long room = capacity[i] - share[i];
+			unsigned long long extra = room < payload.size() - shared ? room : payload.size() - shared;
+			share[i] += extra;
+			shared += extra;
+		}
+
+		// Carriers given nothing to hold are left out, unless there's nothing for any of them
+		unsigned int shard_count = 0;
+		for (size_t i = 0; i < carriers.size(); i++)
+			if (share[i] || (payload.empty() && i == 0))
+				shard_count++;
+		unsigned long long offset = 0;
+		for (size_t i = 0; i < carriers.size(); i++)
+		{
+			if (!share[i] && !(payload.empty() && i == 0))
+				continue;
+			stego_job job;
+			job.args = cmd_args;
+			job.args[MAP_OPERATION_TYPE] = MAP_ENCODE_OPERATION_NAME;
+			job.args[MAP_REF_IMAGE_FILENAME] = carriers[i];
+			std::stringstream filename;
+			filename << cmd_args[MAP_CIPHER_IMAGE_FILENAME] << "_" << jobs.size() << ".png";
+			job.args[MAP_CIPHER_IMAGE_FILENAME] = filename.str();
+			job.header = header;
+			job.header.shard_index = (unsigned int)jobs.size();
+			job.header.shard_count = shard_count;
+			job.text.assign(payload.begin() + (size_t)offset, payload.begin() + (size_t)(offset + share[i]));
+			offset += share[i];
+			jobs.push_back(job);
+		}
+	}
+	catch (std::exception const& e)
+	{
+		std::cout << e.what() << std::endl;
+		return false;
+	}
+
+	for (size_t i = 0; i < jobs.size(); i++)
+		std::cout << "Shard " << i << ": " << jobs[i].text.size() << " bytes in " << jobs[i].args[MAP_REF_IMAGE_FILENAME]
+			<< std::endl;
+	return run_shard_pipeline(jobs, read_job_carrier, embed_job_shard, stage_threads);
+}
+
+// Put a payload spread across images by run_shard back together, and decrypt it as decode would
+// The shards are extracted through run_shard_pipeline, several at once, and can be given in any order, but
+// every shard of the payload has to be there
+// Returns false if it failed, after saying why
+bool run_unshard(std::map<unsigned int, std::string>& cmd_args)
+{
+	unsigned int stage_threads[3];
+	if (!get_stage_threads(cmd_args, 0, stage_threads))
+		return false;
+
+	std::cout << std::endl;
+	std::cout << "Unsharding " << cmd_args[MAP_CIPHER_IMAGE_FILENAME].c_str() << std::endl;
+	std::cout << "to produce the output file: " << cmd_args[MAP_PLAINTEXT_FILENAME].c_str() << std::endl;
+	std::cout << std::endl;
+
+	std::vector<std::string> shards;
+	list_png_files(cmd_args[MAP_CIPHER_IMAGE_FILENAME], shards);
+	if (shards.empty())
+	{
+		std::cout << "Exception in run_unshard: no shard images found" << std::endl;
+		return false;
+	}
+
+	std::vector<stego_job> jobs(shards.size());
+	for (size_t i = 0; i < shards.size(); i++)
+	{
+		jobs[i].args = cmd_args;
+		jobs[i].args[MAP_OPERATION_TYPE] = MAP_DECODE_OPERATION_NAME;
+		jobs[i].args[MAP_CIPHER_IMAGE_FILENAME] = shards[i];
+	}
+	if (!run_shard_pipeline(jobs, read_job_files, extract_job_shard, stage_threads))
+		return false;
+
+	stego_job text_job;
+	text_job.args = cmd_args;
+	try
+	{
+		// Every shard has to be there once, and come from the same payload
+		payload_header header = jobs[0].header;
+		std::vector<stego_job*> by_index(header.shard_count, (stego_job*)NULL);
+		unsigned long long length = 0;
+		for (auto& job : jobs)
+		{
+			const payload_header& shard = job.header;
+			if (shard.shard_count != header.shard_count || shard.payload_length != header.payload_length ||
+				((shard.flags ^ header.flags) & ~PAYLOAD_FLAG_ALPHA) || memcmp(shard.iv, header.iv, sizeof(header.iv)) ||
+				memcmp(shard.salt, header.salt, sizeof(header.salt)) || shard.kdf_iterations != header.kdf_iterations)
+				throw std::exception("Exception in run_unshard: the shards don't all come from the same payload");
+			if (by_index[shard.shard_index])
+				throw std::exception("Exception in run_unshard: a shard was given twice");
+			by_index[shard.shard_index] = &job;
+			length += shard.length;
+		}
+		if (jobs.size() != header.shard_count)
+			throw std::exception("Exception in run_unshard: shards are missing");
+		if (length != header.payload_length)
+			throw std::exception("Exception in run_unshard: the shards don't add up to the payload");
+
+		std::vector<unsigned char> payload;
+		payload.reserve((size_t)length);
+		for (auto job : by_index)
+		{
+			payload.insert(payload.end(), job->text.begin(), job->text.end());
+			std::vector<unsigned char>().swap(job->text);
+		}
+
+		header.flags &= ~PAYLOAD_FLAG_SHARD;
+		header.length = payload.size();
+		payload_reader read = [&](size_t offset, size_t count, unsigned char* bytes)
+		{
+			memcpy(bytes, &payload[offset], count);
+		};
+		decrypt_job_text(text_job, header, read);
 	}
+	catch (std::exception const& e)
+	{
+		std::cout << e.what() << std::endl;
+		return false;
+	}
+
+	run_job_step(encode_job_output, text_job);
+	run_job_step(write_job_output, text_job);
+	if (text_job.failed)
+		std::cout << text_job.error << std::endl;
+	return !text_job.failed;
+}
+
+//		- Load the PNG file into the image data structure [ DONE ] 
+//		- Load the plain text file [ DONE ] 
+//		- Save the image data structure as a new PNG file [ DONE ]
+//		- Save the plain text as a new text file [ DONE ]
+//		- Handle command line input [ DONE ]
+//		- Display usage information [ DONE ]
+//		- Merge the cipher text into the image data structure [ DONE ]
+//		- Load the enciphered PNG file into the enciphered image data structure [ DONE ] 
+//		- Extract the cipher text from the enciphered image data structure [ DONE ]
+//		- Encipher from plain text [ DONE ]
+//		- Decipher to plain text [ DONE ]
+//		- Add command line option to pass the encryption key to be used [ DONE ]
+int main(int argc, char** argv)
+{
+	// With stdin or stdout standing in for a file, keep stdout for the data and send everything we'd
+	// usually print there to stderr instead
+	for (int i = 1; i < argc; i++)
+		if (!strcmp(argv[i], STDIO_FILENAME))
+			std::cout.rdbuf(std::cerr.rdbuf());
+
+	display_about_info();
+
+	std::map<unsigned int, std::string>cmd_args;
+
+	try
+	{
+		capture_args(argc, argv, cmd_args);
+	}
+	catch (std::exception const& e)
+	{
+		//std::cout << e.what() << std::endl;
+		return -1;
+	}
+
+	bool succeeded;
+	if (cmd_args[MAP_OPERATION_TYPE] == MAP_BATCH_OPERATION_NAME)
+		succeeded = run_batch(cmd_args);
+	else if (cmd_args[MAP_OPERATION_TYPE] == MAP_SHARD_OPERATION_NAME)
+		succeeded = run_shard(cmd_args);
+	else if (cmd_args[MAP_OPERATION_TYPE] == MAP_UNSHARD_OPERATION_NAME)
+		succeeded = run_unshard(cmd_args);
+	else
+		succeeded = run_job(cmd_args);
+
+	async_io_drain();
+	openssl_clear_key_cache();
 	
 	std::cout << "End of program execution." << std::endl;
-	return 0;
-}
\ No newline at end of file
+	return succeeded ? 0 : -1;
+}